@@ -43,6 +43,16 @@ static Color colors[] = {
 #define NMASTER 1
 /* scroll back buffer size in lines */
 #define SCROLL_HISTORY 500
+/* maximum number of screen updates per second, 0 for no limit */
+#define REFRESH_RATE 60
+/* maximum number of updates per second of windows without focus */
+#define REFRESH_RATE_UNFOCUSED 20
+/* bytes of output a window without focus processes at once, multiplied
+ * by its priority (see the priority command) */
+#define READ_CHUNK 2048
+/* bytes of output of all windows without focus processed before keyboard
+ * input and the focused window are looked at again */
+#define READ_BUDGET 16384
 /* printf format string for the tag in the status bar */
 #define TAG_SYMBOL   "[%s]"
 /* curses attributes for the currently selected tags */
@@ -197,6 +207,8 @@ static Cmd commands[] = {
 	{ "focus",  { focusid,	{ NULL } } },
 	/* tag <win_id> <tag> [tag ...]: add +tag, remove -tag or set tag of the window with the given identifier */
 	{ "tag",    { tagid,	{ NULL } } },
+	/* priority <win_id> <n>: let the window process n [1..16] times more output at once than by default */
+	{ "priority", { priorityid, { NULL } } },
 };
 
 /* gets executed when dvtm is started */
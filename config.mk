@@ -9,6 +9,20 @@ TERMINFO := ${DESTDIR}${PREFIX}/share/terminfo
 INCS = -I.
 LIBS = -lc -lutil -lncursesw
 CPPFLAGS = -D_POSIX_C_SOURCE=200809L -D_XOPEN_SOURCE=700 -D_XOPEN_SOURCE_EXTENDED
+# uncomment to write screen updates directly to the terminal instead of
+# through doupdate(3), requires ncurses
+#CPPFLAGS += -DCONFIG_DIRECT_RENDER
+# uncomment to additionally write the output from a separate thread, the
+# terminal can then never hold up reading from the ptys
+#CPPFLAGS += -DCONFIG_RENDER_THREAD
+#LIBS += -pthread
+# uncomment to read and interpret the output of every window on a thread
+# of its own, which spreads the work over multiple cores
+#CPPFLAGS += -DCONFIG_READ_THREAD
+#LIBS += -pthread
+# uncomment to keep reads posted on the ptys through io_uring(7) instead of
+# reading them once they are reported readable, Linux 5.11 or later
+#CPPFLAGS += -DCONFIG_IO_URING
 CFLAGS += -std=c99 ${INCS} -DNDEBUG ${CPPFLAGS}
 
 CC ?= cc
@@ -21,6 +21,7 @@
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <curses.h>
@@ -36,7 +37,19 @@
 #if defined __CYGWIN__ || defined __sun
 # include <termios.h>
 #endif
+#ifdef __linux__
+# include <poll.h>
+# include <sys/epoll.h>
+# include <sys/signalfd.h>
+# include <sys/syscall.h>
+long syscall(long number, ...);
+#endif
+#ifdef CONFIG_IO_URING
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+#endif
 #include "vt.h"
+#include "render.h"
 
 #ifdef PDCURSES
 int ESCDELAY;
@@ -79,6 +92,21 @@ struct Client {
 	bool has_title_line;
 	bool minimized;
 	bool urgent;
+	bool shown;              /* content is displayed at the current position */
+	uint64_t deferred;       /* time postponed content changes are drawn, 0 if none */
+	uint64_t drawn;          /* time the content was last drawn */
+	uint64_t sync_start;     /* time the application began a synchronized update */
+	bool ready;              /* pty has data to read */
+	bool queued;             /* pty is also polled until queued input is written */
+	unsigned int priority;   /* multiple of READ_CHUNK read at once */
+	int pidfd;               /* readable once the application exited, -1 if unused */
+	int editor_pidfd;        /* readable once the editor exited, -1 if unused */
+	bool exited;             /* one of the pidfds became readable */
+#ifdef CONFIG_IO_URING
+	bool ringed;             /* output is read through the io_uring instance */
+	bool reading;            /* a read is in progress */
+	int result;              /* result of the completed read, -errno on error */
+#endif
 	volatile sig_atomic_t died;
 	Client *next;
 	Client *prev;
@@ -137,6 +165,16 @@ typedef struct {
 
 enum { BAR_TOP, BAR_BOTTOM, BAR_OFF };
 
+/* everything displayed by the status bar */
+typedef struct {
+	unsigned int tags, occupied, urgent;
+	bool runinall;
+	const char *symbol;
+	KeyCombo keys;
+	int y, w;
+	char text[512];
+} BarState;
+
 typedef struct {
 	int fd;
 	int pos, lastpos;
@@ -145,12 +183,16 @@ typedef struct {
 	unsigned short int y;
 	char text[512];
 	const char *file;
+	BarState drawn;         /* state the bar was last drawn with */
+	bool drawn_valid;       /* false if the bar has to be redrawn */
+	bool ready;             /* fifo has data to read */
 } StatusBar;
 
 typedef struct {
 	int fd;
 	const char *file;
 	unsigned short int id;
+	bool ready;
 } CmdFifo;
 
 typedef struct {
@@ -171,6 +213,17 @@ typedef struct {
 #define MIN(x, y)   ((x) < (y) ? (x) : (y))
 #define TAGMASK     ((1 << LENGTH(tags)) - 1)
 
+#define NSEC_PER_SEC 1000000000ULL
+/* minimal time between two frames for the given rate, 0 if unlimited */
+#define FRAME_INTERVAL(rate) ((rate) > 0 ? NSEC_PER_SEC / (rate) : 0)
+/* output of the focused client arriving within this time after
+ * a key press is considered an echo and displayed immediately */
+#define ECHO_TIMEOUT (NSEC_PER_SEC / 10)
+/* maximal time a synchronized update (mode 2026) of a client is held back */
+#define SYNC_TIMEOUT (NSEC_PER_SEC / 5)
+/* number of submission queue entries of the io_uring instance */
+#define RING_ENTRIES 64
+
 #ifdef NDEBUG
  #define debug(format, args...)
 #else
@@ -203,6 +256,7 @@ static void setmfact(const char *args[]);
 static void startup(const char *args[]);
 static void tag(const char *args[]);
 static void tagid(const char *args[]);
+static void priorityid(const char *args[]);
 static void togglebar(const char *args[]);
 static void togglebarpos(const char *args[]);
 static void toggleminimize(const char *args[]);
@@ -224,6 +278,7 @@ static void mouse_zoom(const char *args[]);
 static Client* nextvisible(Client *c);
 static void focus(Client *c);
 static void resize(Client *c, int x, int y, int w, int h);
+static int read_client(Client *c, size_t max);
 extern Screen screen;
 static unsigned int waw, wah, wax, way;
 static Client *clients = NULL;
@@ -238,6 +293,40 @@ Screen screen = { .mfact = MFACT, .nmaster = NMASTER, .history = SCROLL_HISTORY
 static Client *stack = NULL;
 static Client *sel = NULL;
 static Client *lastsel = NULL;
+static Client *readnext;         /* client which is read from first, NULL for all */
+static bool direct_render;
+static bool update_pending;
+static const char *sync_output;  /* terminfo Sync capability of the terminal */
+/* frame pacing, times are nanoseconds of the monotonic clock */
+static uint64_t frame_last;      /* time of the last screen update */
+static uint64_t frame_count_start; /* start of the interval in which redraws are counted */
+static unsigned int frame_count; /* redraws since then, reported through debug() */
+static bool frame_immediate;     /* update without waiting for the next frame */
+static uint64_t input_time;      /* time of the last keyboard input */
+static bool input_ready;         /* keyboard input is available */
+static bool signal_ready;        /* signals are pending on signal_fd */
+static volatile sig_atomic_t untracked; /* children only reaped by sigchld_handler() */
+#ifdef __linux__
+static int signal_fd = -1;       /* signalfd(2) through which signals are received */
+static int poll_fd = -1;         /* epoll(7) instance the descriptors are registered with */
+static bool poll_output;         /* whether the terminal is polled for writability */
+#endif
+#ifdef CONFIG_IO_URING
+/* io_uring(7) instance through which reads are kept posted on the ptys. The
+ * epoll instance is polled through it too, a single system call then waits
+ * for all events and submits the reads for the next ones */
+static struct {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	bool polling;            /* whether the epoll instance is polled */
+	bool events;             /* the epoll instance became readable */
+} ring = { .fd = -1 };
+#endif
+static WINDOW *keywin;
 static Client *msel = NULL;
 static unsigned int seltags;
 static unsigned int tagset[2] = { 1, 1 };
@@ -313,6 +402,8 @@ hidebar(void) {
 	if (bar.pos != BAR_OFF) {
 		bar.lastpos = bar.pos;
 		bar.pos = BAR_OFF;
+		/* clients will be drawn over it */
+		bar.drawn_valid = false;
 	}
 }
 
@@ -322,18 +413,41 @@ showbar(void) {
 		bar.pos = bar.lastpos;
 }
 
+/* all window updates go through here, the screen is only
+ * updated if something was queued since the last frame */
+static void
+queue_refresh(WINDOW *win) {
+	wnoutrefresh(win);
+	update_pending = true;
+}
+
 static void
 drawbar(void) {
 	int sx, sy, x, y, width;
-	unsigned int occupied = 0, urgent = 0;
 	if (bar.pos == BAR_OFF)
 		return;
 
+	/* the bar is called for after every key press, only redraw
+	 * it if anything it displays changed since the last time */
+	BarState state;
+	memset(&state, 0, sizeof state);
 	for (Client *c = clients; c; c = c->next) {
-		occupied |= c->tags;
+		state.occupied |= c->tags;
 		if (c->urgent)
-			urgent |= c->tags;
+			state.urgent |= c->tags;
 	}
+	state.tags = tagset[seltags];
+	state.runinall = runinall;
+	state.symbol = layout->symbol;
+	memcpy(state.keys, keys, sizeof keys);
+	state.y = bar.y;
+	state.w = screen.w;
+	strncpy(state.text, bar.text, sizeof state.text);
+	if (bar.drawn_valid && !memcmp(&state, &bar.drawn, sizeof state))
+		return;
+	memcpy(&bar.drawn, &state, sizeof state);
+	bar.drawn_valid = true;
+	unsigned int occupied = state.occupied, urgent = state.urgent;
 
 	getyx(stdscr, sy, sx);
 	attrset(BAR_ATTR);
@@ -391,7 +505,7 @@ drawbar(void) {
 	mvaddch(bar.y, screen.w - 1, BAR_END);
 	attrset(NORMAL_ATTR);
 	move(sy, sx);
-	wnoutrefresh(stdscr);
+	queue_refresh(stdscr);
 }
 
 static int
@@ -404,7 +518,8 @@ draw_border(Client *c) {
 	char t = '\0';
 	int x, y, maxlen, attrs = NORMAL_ATTR;
 
-	if (!show_border())
+	/* the window shares its cells with whichever client is shown there */
+	if (!show_border() || !isvisible(c))
 		return;
 	if (sel != c && c->urgent)
 		attrs = URGENT_ATTR;
@@ -433,28 +548,358 @@ draw_border(Client *c) {
 
 static void
 draw_content(Client *c) {
+	VtDamage damage;
+	/* vt_draw() scrolls the window, let the renderer do the same on the
+	 * terminal; curses detects the moved lines by itself */
+	if (direct_render && vt_damage_get(c->term, &damage) && damage.scroll) {
+		int y = c->y + c->has_title_line;
+		render_scroll(y + damage.scroll_top, y + damage.scroll_bot,
+		              c->x, c->x + c->w, damage.scroll);
+	}
 	vt_draw(c->term, c->window, c->has_title_line, 0);
 }
 
+/* registers a descriptor which is waited on by wait_events(), ready is
+ * set once it becomes readable */
+static void
+watch_fd(int fd, bool *ready) {
+#ifdef __linux__
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = ready };
+	if (fd != -1)
+		epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &ev);
+#endif
+}
+
+static void
+unwatch_fd(int fd) {
+#ifdef __linux__
+	if (fd != -1)
+		epoll_ctl(poll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+}
+
+/* returns a descriptor which becomes readable once the process exited,
+ * -1 if the kernel does not support it */
+static int
+open_pidfd(pid_t pid) {
+#if defined __linux__ && defined SYS_pidfd_open
+	return pid > 0 ? syscall(SYS_pidfd_open, pid, 0) : -1;
+#else
+	return -1;
+#endif
+}
+
+#ifdef CONFIG_IO_URING
+/* sets up the io_uring instance, on failure the ptys are read as usual */
+static void
+ring_setup(void) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(SYS_io_uring_setup, RING_ENTRIES, &p);
+	if (fd == -1)
+		return;
+	/* the timeout of io_uring_enter(2) requires IORING_FEAT_EXT_ARG */
+	if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(fd);
+		return;
+	}
+	size_t size = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+	                  p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	char *rings = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	                  PROT_READ|PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		munmap(rings, size);
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	ring.fd = fd;
+	ring.entries = p.sq_entries;
+	ring.sq_head = (unsigned *)(rings + p.sq_off.head);
+	ring.sq_tail = (unsigned *)(rings + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)(rings + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(rings + p.sq_off.array);
+	ring.cq_head = (unsigned *)(rings + p.cq_off.head);
+	ring.cq_tail = (unsigned *)(rings + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)(rings + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+	ring.sqes = sqes;
+}
+
+/* submits the queued requests and waits for at least wait completions or
+ * the timeout to expire, returns -1 on error */
+static int
+ring_enter(unsigned wait, const struct timespec *timeout) {
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	if (timeout) {
+		ts.tv_sec = timeout->tv_sec;
+		ts.tv_nsec = timeout->tv_nsec;
+		arg.ts = (uintptr_t)&ts;
+	}
+	unsigned submit = *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	unsigned flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+	int r = syscall(SYS_io_uring_enter, ring.fd, submit, wait, flags, &arg, sizeof(arg));
+	if (r == -1 && errno == ETIME)
+		r = 0;
+	return r;
+}
+
+/* returns a cleared submission queue entry which is submitted by the
+ * next ring_enter(), NULL if the queue is full */
+static struct io_uring_sqe*
+ring_sqe(void) {
+	unsigned tail = *ring.sq_tail;
+	if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.entries) {
+		if (ring_enter(0, NULL) <= 0)
+			return NULL;
+	}
+	unsigned index = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[index] = index;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+/* posts a read into the buffer of the client's terminal */
+static void
+ring_read(Client *c) {
+	size_t len;
+	char *buf = vt_readbuf_get(c->term, &len);
+	struct io_uring_sqe *sqe = ring_sqe();
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = vt_pty_get(c->term);
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = (uintptr_t)c;
+	c->reading = true;
+}
+
+/* handles the completed requests, returns their number */
+static int
+ring_reap(void) {
+	int n = 0;
+	unsigned head = *ring.cq_head;
+	unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+		if (!cqe->user_data) {
+			ring.polling = false;
+			ring.events = true;
+			continue;
+		}
+		if (cqe->user_data == (uintptr_t)&ring)
+			continue; /* cancellation request */
+		Client *c = (Client *)(uintptr_t)cqe->user_data;
+		c->reading = false;
+		if (cqe->res == -EAGAIN) {
+			/* the pty does not support waiting for data */
+			unwatch_fd(vt_pty_get(c->term));
+			c->ringed = c->queued = false;
+			watch_fd(vt_pty_get(c->term), &c->ready);
+			continue;
+		}
+		c->result = cqe->res;
+		c->ready = true;
+		n++;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* cancels the read posted for the client and waits until it completed */
+static void
+ring_cancel(Client *c) {
+	if (!c->reading)
+		return;
+	struct io_uring_sqe *sqe = ring_sqe();
+	if (sqe) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uintptr_t)c;
+		sqe->user_data = (uintptr_t)&ring;
+	}
+	while (c->reading && ring_enter(1, NULL) != -1)
+		ring_reap();
+}
+#endif
+
+/* the output of the client's terminal is read through the io_uring
+ * instance if there is one, its descriptor is waited on otherwise */
+static void
+watch_client(Client *c) {
+#ifdef CONFIG_IO_URING
+	c->ringed = ring.fd != -1 && vt_fd_get(c->term) == vt_pty_get(c->term);
+	if (c->ringed)
+		return;
+#endif
+	watch_fd(vt_fd_get(c->term), &c->ready);
+}
+
+static void
+unwatch_client(Client *c) {
+#ifdef CONFIG_IO_URING
+	ring_cancel(c);
+#endif
+	unwatch_fd(vt_fd_get(c->term));
+}
+
+static void
+close_pidfd(int *fd) {
+	if (*fd == -1)
+		return;
+	unwatch_fd(*fd);
+	close(*fd);
+	*fd = -1;
+}
+
+/* returns a descriptor watched for the exit of a newly forked child, if
+ * there is none the child is reaped by sigchld_handler() */
+static int
+watch_pid(pid_t pid, bool *exited) {
+	int fd = open_pidfd(pid);
+	if (fd == -1 && pid > 0)
+		untracked++;
+	watch_fd(fd, exited);
+	return fd;
+}
+
+/* stops watching a child which is no longer of interest, if it is still
+ * running it is left to sigchld_handler() */
+static void
+unwatch_pid(int *fd, pid_t pid) {
+	if (*fd == -1)
+		return;
+	if (waitpid(pid, NULL, WNOHANG) == 0)
+		untracked++;
+	close_pidfd(fd);
+}
+
+static uint64_t
+clock_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* whether the next frame changes any cells instead of only moving the cursor */
+static bool
+screen_touched(void) {
+	for (int y = 0; y < LINES; y++) {
+		if (is_linetouched(newscr, y))
+			return true;
+	}
+	return false;
+}
+
+/* writes the whole buffer to the terminal, waits while it does not
+ * accept output */
+static void
+write_all(const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(STDOUT_FILENO, buf, len);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				fd_set wr;
+				FD_ZERO(&wr);
+				FD_SET(STDOUT_FILENO, &wr);
+				select(STDOUT_FILENO + 1, NULL, &wr, NULL, NULL);
+			} else if (errno != EINTR) {
+				return;
+			}
+			continue;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void
+screen_update(void) {
+	if (!update_pending)
+		return;
+	update_pending = false;
+	frame_immediate = false;
+	frame_last = clock_now();
+	if (frame_last - frame_count_start >= NSEC_PER_SEC) {
+		if (frame_count_start)
+			debug("redraws per second: %llu\n", (unsigned long long)
+			      (frame_count * NSEC_PER_SEC / (frame_last - frame_count_start)));
+		frame_count = 0;
+		frame_count_start = frame_last;
+	}
+	frame_count++;
+	if (direct_render) {
+		render_update();
+	} else if (sync_output && screen_touched()) {
+		/* doupdate(3) flushed all previous output, ordering is thus kept */
+		const char *s = tiparm(sync_output, 1);
+		write_all(s, strlen(s));
+		doupdate();
+		/* the terminal would otherwise not display anything anymore */
+		s = tiparm(sync_output, 2);
+		write_all(s, strlen(s));
+	} else {
+		doupdate();
+	}
+}
+
+/* whether the terminal did not yet consume previous output, further screen
+ * updates are then postponed and merged until it catches up */
+static bool
+output_busy(void) {
+	if (direct_render)
+		return render_flush() > 0;
+	fd_set wr;
+	struct timeval tv = { 0 };
+	FD_ZERO(&wr);
+	FD_SET(STDOUT_FILENO, &wr);
+	return select(STDOUT_FILENO + 1, NULL, &wr, NULL, &tv) == 0;
+}
+
+static void
+cursor_show(bool visible) {
+	update_pending = true;
+	if (direct_render)
+		render_cursor(visible);
+	else
+		curs_set(visible);
+}
+
 static void
 draw(Client *c) {
 	if (is_content_visible(c)) {
-		redrawwin(c->window);
+		/* client windows share their cells with stdscr, which might
+		 * have been erased or overdrawn by another client since. The
+		 * content is copied again, curses still skips cells which are
+		 * already shown on the terminal */
+		vt_dirty(c->term);
 		draw_content(c);
 	}
+	c->shown = is_content_visible(c);
 	if (!isarrange(fullscreen) || sel == c)
 		draw_border(c);
-	wnoutrefresh(c->window);
+	queue_refresh(c->window);
 }
 
 static void
 draw_all(void) {
 	if (!nextvisible(clients)) {
 		sel = NULL;
-		curs_set(0);
+		cursor_show(false);
 		erase();
+		bar.drawn_valid = false;
 		drawbar();
-		doupdate();
+		screen_update();
 		return;
 	}
 
@@ -472,6 +917,50 @@ draw_all(void) {
 		draw(sel);
 }
 
+/* resizes the visible clients and draws the separators between them */
+static void
+layout_apply(unsigned int m) {
+	if (m && !isarrange(fullscreen))
+		wah--;
+	layout->arrange();
+	if (m && !isarrange(fullscreen)) {
+		unsigned int i = 0, nw = waw / m, nx = wax;
+		for (Client *c = nextvisible(clients); c; c = nextvisible(c->next)) {
+			if (c->minimized) {
+				resize(c, nx, way+wah, ++i == m ? waw - nx : nw, 1);
+				nx += nw;
+			}
+		}
+		wah++;
+	}
+}
+
+/* blanks the cells of the window area which no visible client covers,
+ * returns whether there were any */
+static bool
+erase_uncovered(void) {
+	bool erased = false;
+	for (unsigned int y = way; y < way + wah; y++) {
+		for (unsigned int x = wax; x < wax + waw; ) {
+			unsigned int end = wax + waw;
+			for (Client *c = nextvisible(clients); c; c = nextvisible(c->next)) {
+				if (y < c->y || y >= c->y + c->h || x >= c->x + c->w)
+					continue;
+				if (x >= c->x)
+					end = x = c->x + c->w;
+				else if (c->x < end)
+					end = c->x;
+			}
+			if (x < end) {
+				mvhline(y, x, ' ', end - x);
+				erased = true;
+			}
+			x = end;
+		}
+	}
+	return erased;
+}
+
 static void
 arrange(void) {
 	unsigned int m = 0, n = 0;
@@ -480,7 +969,6 @@ arrange(void) {
 		if (c->minimized)
 			m++;
 	}
-	erase();
 	attrset(NORMAL_ATTR);
 	if (bar.fd == -1 && bar.autohide) {
 		if ((!clients || !clients->next) && n == 1)
@@ -489,23 +977,45 @@ arrange(void) {
 			showbar();
 		updatebarpos();
 	}
-	if (m && !isarrange(fullscreen))
-		wah--;
-	layout->arrange();
-	if (m && !isarrange(fullscreen)) {
-		unsigned int i = 0, nw = waw / m, nx = wax;
-		for (Client *c = nextvisible(clients); c; c = nextvisible(c->next)) {
-			if (c->minimized) {
-				resize(c, nx, way+wah, ++i == m ? waw - nx : nw, 1);
-				nx += nw;
-			}
-		}
-		wah++;
-	}
+	/* instead of erasing the whole screen only the remains of the previous
+	 * arrangement are cleared. The separators drawn by the layout are not
+	 * covered by any client either, if something was blanked the layout is
+	 * applied once more to restore them. The geometry is unchanged by then,
+	 * resize() thus leaves the clients alone */
+	layout_apply(m);
+	if (erase_uncovered())
+		layout_apply(m);
 	focus(NULL);
-	wnoutrefresh(stdscr);
+	queue_refresh(stdscr);
 	drawbar();
-	draw_all();
+	if (!nextvisible(clients)) {
+		draw_all();
+		return;
+	}
+
+	/* clients which kept their place and were shown before still display
+	 * their content, only the border is updated */
+	for (Client *c = clients; c; c = c->next) {
+		if (!is_content_visible(c))
+			c->shown = false;
+	}
+	for (Client *c = nextvisible(clients); c; c = nextvisible(c->next)) {
+		if (c == sel)
+			continue;
+		if (c->shown) {
+			draw_border(c);
+			queue_refresh(c->window);
+		} else {
+			draw(c);
+		}
+	}
+	/* the selected window comes last, it determines the cursor position */
+	if (sel && sel->shown) {
+		draw_border(sel);
+		queue_refresh(sel->window);
+	} else if (sel) {
+		draw(sel);
+	}
 }
 
 static void
@@ -566,7 +1076,7 @@ settitle(Client *c) {
 	if (t && (term = getenv("TERM")) && !strstr(term, "linux")) {
 		printf("\033]0;%s\007", t);
 		fflush(stdout);
-		wnoutrefresh(c->window);
+		queue_refresh(c->window);
 	}
 }
 
@@ -589,7 +1099,7 @@ focus(Client *c) {
 		lastsel->urgent = false;
 		if (!isarrange(fullscreen)) {
 			draw_border(lastsel);
-			wnoutrefresh(lastsel->window);
+			queue_refresh(lastsel->window);
 		}
 	}
 
@@ -602,10 +1112,10 @@ focus(Client *c) {
 			draw(c);
 		} else {
 			draw_border(c);
-			wnoutrefresh(c->window);
+			queue_refresh(c->window);
 		}
 	}
-	curs_set(c && !c->minimized && vt_cursor_visible(c->term));
+	cursor_show(c && !c->minimized && vt_cursor_visible(c->term));
 }
 
 static void
@@ -634,8 +1144,10 @@ term_title_handler(Vt *term, const char *title) {
 		strncpy(c->title, title, sizeof(c->title) - 1);
 	c->title[title ? sizeof(c->title) - 1 : 0] = '\0';
 	settitle(c);
-	if (!isarrange(fullscreen) || sel == c)
+	if (!isarrange(fullscreen) || sel == c) {
 		draw_border(c);
+		queue_refresh(c->window);
+	}
 	applycolorrules(c);
 }
 
@@ -646,50 +1158,58 @@ term_urgent_handler(Vt *term) {
 	printf("\a");
 	fflush(stdout);
 	drawbar();
-	if (!isarrange(fullscreen) && sel != c && isvisible(c))
+	if (!isarrange(fullscreen) && sel != c && isvisible(c)) {
 		draw_border(c);
+		queue_refresh(c->window);
+	}
 }
 
-static void
-move_client(Client *c, int x, int y) {
-	if (c->x == x && c->y == y)
-		return;
-	debug("moving, x: %d y: %d\n", x, y);
-	if (mvwin(c->window, y, x) == ERR) {
-		eprint("error moving, x: %d y: %d\n", x, y);
-	} else {
-		c->x = x;
-		c->y = y;
+/* client windows are derived from stdscr and share its cells, there is no
+ * separate copy of their content. Instead of moving or resizing them, which
+ * curses does not reliably support for subwindows, a new one is derived */
+static WINDOW*
+client_window(int x, int y, int w, int h) {
+	WINDOW *win = derwin(stdscr, h, w, y, x);
+	if (win) {
+		/* allow curses to use insert/delete line when the window scrolls */
+		idlok(win, TRUE);
 	}
+	return win;
 }
 
 static void
-resize_client(Client *c, int w, int h) {
+resize(Client *c, int x, int y, int w, int h) {
 	bool has_title_line = show_border();
 	bool resize_window = c->w != w || c->h != h;
-	if (resize_window) {
-		debug("resizing, w: %d h: %d\n", w, h);
-		if (wresize(c->window, h, w) == ERR) {
-			eprint("error resizing, w: %d h: %d\n", w, h);
-		} else {
-			c->w = w;
-			c->h = h;
+	int wx, wy, ww, wh;
+	/* resizeterm(3) might have adjusted the window behind our back */
+	getbegyx(c->window, wy, wx);
+	getmaxyx(c->window, wh, ww);
+	if (c->x != x || c->y != y || resize_window || wx != x || wy != y || ww != w || wh != h) {
+		debug("resizing, x: %d y: %d w: %d h: %d\n", x, y, w, h);
+		WINDOW *win = client_window(x, y, w, h);
+		if (!win) {
+			eprint("error resizing, x: %d y: %d w: %d h: %d\n", x, y, w, h);
+			return;
 		}
+		delwin(c->window);
+		c->window = win;
+		c->x = x;
+		c->y = y;
+		c->w = w;
+		c->h = h;
+		c->shown = false;
+		vt_dirty(c->term);
 	}
 	if (resize_window || c->has_title_line != has_title_line) {
 		c->has_title_line = has_title_line;
+		c->shown = false;
 		vt_resize(c->app, h - has_title_line, w);
 		if (c->editor)
 			vt_resize(c->editor, h - has_title_line, w);
 	}
 }
 
-static void
-resize(Client *c, int x, int y, int w, int h) {
-	resize_client(c, w, h);
-	move_client(c, x, y);
-}
-
 static Client*
 get_client_by_coord(unsigned int x, unsigned int y) {
 	if (y < way || y >= way+wah)
@@ -711,7 +1231,7 @@ sigchld_handler(int sig) {
 	int status;
 	pid_t pid;
 
-	while ((pid = waitpid(-1, &status, WNOHANG)) != 0) {
+	while (untracked && (pid = waitpid(-1, &status, WNOHANG)) != 0) {
 		if (pid == -1) {
 			if (errno == ECHILD) {
 				/* no more child processes */
@@ -723,21 +1243,45 @@ sigchld_handler(int sig) {
 
 		debug("child with pid %d died\n", pid);
 
+		/* a child with a pidfd may be reaped here first, reap() then
+		 * still notices its exit through the pidfd */
+		bool tracked = false;
 		for (Client *c = clients; c; c = c->next) {
 			if (c->pid == pid) {
+				tracked = c->pidfd != -1;
 				c->died = true;
 				break;
 			}
 			if (c->editor && vt_pid_get(c->editor) == pid) {
+				tracked = c->editor_pidfd != -1;
 				c->editor_died = true;
 				break;
 			}
 		}
+		if (!tracked)
+			untracked--;
 	}
 
 	errno = errsv;
 }
 
+/* reaps the application or editor of a client whose pidfd became readable,
+ * waitpid() fails if sigchld_handler() got to it first */
+static void
+reap(Client *c) {
+	c->exited = false;
+	if (c->editor_pidfd != -1 && waitpid(vt_pid_get(c->editor), NULL, WNOHANG)) {
+		debug("editor of client with pid %d died\n", c->pid);
+		close_pidfd(&c->editor_pidfd);
+		c->editor_died = true;
+	}
+	if (c->pidfd != -1 && waitpid(c->pid, NULL, WNOHANG)) {
+		debug("child with pid %d died\n", c->pid);
+		close_pidfd(&c->pidfd);
+		c->died = true;
+	}
+}
+
 static void
 sigwinch_handler(int sig) {
 	screen.need_resize = true;
@@ -748,6 +1292,27 @@ sigterm_handler(int sig) {
 	running = false;
 }
 
+/* dispatches the signals received through signal_fd */
+static void
+handle_signals(void) {
+#ifdef __linux__
+	struct signalfd_siginfo si;
+	while (read(signal_fd, &si, sizeof si) == sizeof si) {
+		switch (si.ssi_signo) {
+		case SIGCHLD:
+			sigchld_handler(SIGCHLD);
+			break;
+		case SIGWINCH:
+			sigwinch_handler(SIGWINCH);
+			break;
+		case SIGTERM:
+			sigterm_handler(SIGTERM);
+			break;
+		}
+	}
+#endif
+}
+
 static void
 resize_screen(void) {
 	struct winsize ws;
@@ -765,6 +1330,10 @@ resize_screen(void) {
 	wresize(stdscr, screen.h, screen.w);
 	updatebarpos();
 	clear();
+	/* everything has to be drawn again */
+	bar.drawn_valid = false;
+	for (Client *c = clients; c; c = c->next)
+		c->shown = false;
 	arrange();
 }
 
@@ -841,6 +1410,21 @@ tagid(const char *args[]) {
 	}
 }
 
+static void
+priorityid(const char *args[]) {
+	if (!args[0] || !args[1])
+		return;
+
+	const int win_id = atoi(args[0]);
+	for (Client *c = clients; c; c = c->next) {
+		if (c->id == win_id) {
+			int priority = atoi(args[1]);
+			c->priority = MIN(MAX(priority, 1), 16);
+			return;
+		}
+	}
+}
+
 static void
 toggletag(const char *args[]) {
 	if (!sel)
@@ -885,15 +1469,15 @@ keypress(int code) {
 
 	if (code == '\e') {
 		/* pass characters following escape to the underlying app */
-		nodelay(stdscr, TRUE);
-		for (int t; len < sizeof(buf) && (t = getch()) != ERR; len++) {
+		nodelay(keywin, TRUE);
+		for (int t; len < sizeof(buf) && (t = wgetch(keywin)) != ERR; len++) {
 			if (t > 255) {
 				key = t;
 				break;
 			}
 			buf[len] = t;
 		}
-		nodelay(stdscr, FALSE);
+		nodelay(keywin, FALSE);
 	}
 
 	for (Client *c = runinall ? nextvisible(clients) : sel; c; c = nextvisible(c->next)) {
@@ -956,7 +1540,22 @@ setup(void) {
 	start_color();
 	noecho();
 	nonl();
-	keypad(stdscr, TRUE);
+	/* input is read through a window which is never touched, wgetch(3)
+	 * would otherwise refresh stdscr behind the back of the renderer */
+	direct_render = render_init();
+	keywin = direct_render ? newwin(1, 1, 0, 0) : stdscr;
+	if (!keywin) {
+		render_shutdown();
+		direct_render = false;
+		keywin = stdscr;
+	}
+	if (direct_render)
+		untouchwin(keywin);
+	/* wrap screen updates in synchronized output sequences (mode 2026) */
+	sync_output = tigetstr("Sync");
+	if (sync_output == (char*)-1)
+		sync_output = NULL;
+	keypad(keywin, TRUE);
 	mouse_setup();
 	raw();
 	vt_init();
@@ -971,16 +1570,48 @@ setup(void) {
 		colors[i].pair = vt_color_reserve(colors[i].fg, colors[i].bg);
 	}
 	resize_screen();
+#ifdef __linux__
+	if ((poll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		error("epoll_create1: %s\n", strerror(errno));
+#endif
+#ifdef CONFIG_IO_URING
+	ring_setup();
+#endif
+	watch_fd(STDIN_FILENO, &input_ready);
+	watch_fd(cmdfifo.fd, &cmdfifo.ready);
+	watch_fd(bar.fd, &bar.ready);
+	watch_fd(render_fd(), NULL);
 	struct sigaction sa;
 	memset(&sa, 0, sizeof sa);
 	sa.sa_flags = 0;
 	sigemptyset(&sa.sa_mask);
+#ifdef __linux__
+	/* signals are blocked and received through signal_fd. Exited children
+	 * are thus only reaped by handle_signals(), they remain zombies until
+	 * then and their pidfds can be opened right after they were forked */
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGWINCH);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	if ((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC)) == -1)
+		error("signalfd: %s\n", strerror(errno));
+	watch_fd(signal_fd, &signal_ready);
+#else
 	sa.sa_handler = sigwinch_handler;
 	sigaction(SIGWINCH, &sa, NULL);
 	sa.sa_handler = sigchld_handler;
 	sigaction(SIGCHLD, &sa, NULL);
 	sa.sa_handler = sigterm_handler;
 	sigaction(SIGTERM, &sa, NULL);
+	/* the handlers only run while waiting for events */
+	sigset_t blockset;
+	sigemptyset(&blockset);
+	sigaddset(&blockset, SIGWINCH);
+	sigaddset(&blockset, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &blockset, NULL);
+#endif
 	sa.sa_handler = SIG_IGN;
 	sigaction(SIGPIPE, &sa, NULL);
 }
@@ -1002,8 +1633,25 @@ destroy(Client *c) {
 	}
 	if (lastsel == c)
 		lastsel = NULL;
-	werase(c->window);
-	wnoutrefresh(c->window);
+	if (readnext == c)
+		readnext = NULL;
+	/* the window shares its cells with stdscr. A hidden one still covers
+	 * its last place, which other clients might occupy by now */
+	if (isvisible(c)) {
+		werase(c->window);
+		queue_refresh(c->window);
+	}
+	for (Client *o = clients; o; o = o->next) {
+		if (o->x < c->x + c->w && c->x < o->x + o->w &&
+		    o->y < c->y + c->h && c->y < o->y + o->h) {
+			o->shown = false;
+			vt_dirty(o->term);
+		}
+	}
+	unwatch_pid(&c->pidfd, c->pid);
+	if (c->editor)
+		unwatch_pid(&c->editor_pidfd, vt_pid_get(c->editor));
+	unwatch_client(c);
 	vt_destroy(c->term);
 	delwin(c->window);
 	if (!clients && LENGTH(actions)) {
@@ -1021,6 +1669,7 @@ cleanup(void) {
 	while (clients)
 		destroy(clients);
 	vt_shutdown();
+	render_shutdown();
 	endwin();
 	free(copyreg.data);
 	if (bar.fd > 0)
@@ -1060,9 +1709,11 @@ create(const char *args[]) {
 		return;
 	c->tags = tagset[seltags];
 	c->id = ++cmdfifo.id;
+	c->pidfd = c->editor_pidfd = -1;
+	c->priority = 1;
 	snprintf(buf, sizeof buf, "%d", c->id);
 
-	if (!(c->window = newwin(wah, waw, way, wax))) {
+	if (!(c->window = client_window(wax, way, waw, wah))) {
 		free(c);
 		return;
 	}
@@ -1093,6 +1744,8 @@ create(const char *args[]) {
 	c->pid = vt_forkpty(c->term, shell, pargs, cwd, env, NULL, NULL);
 	if (args && args[2] && !strcmp(args[2], "$CWD"))
 		free(cwd);
+	watch_client(c);
+	c->pidfd = watch_pid(c->pid, &c->exited);
 	vt_data_set(c->term, c);
 	vt_title_handler_set(c->term, term_title_handler);
 	vt_urgent_handler_set(c->term, term_urgent_handler);
@@ -1132,7 +1785,14 @@ copymode(const char *args[]) {
 		return;
 	}
 
+	/* the application is not read from while the editor is active */
+	unwatch_client(sel);
+	if (sel->ready)
+		read_client(sel, SIZE_MAX);
 	sel->term = sel->editor;
+	sel->ready = sel->queued = false;
+	watch_client(sel);
+	sel->editor_pidfd = watch_pid(vt_pid_get(sel->editor), &sel->exited);
 
 	if (sel->editor_fds[0] != -1) {
 		char *buf = NULL;
@@ -1320,7 +1980,7 @@ redraw(const char *args[]) {
 		if (!c->minimized) {
 			vt_dirty(c->term);
 			wclear(c->window);
-			wnoutrefresh(c->window);
+			queue_refresh(c->window);
 		}
 	}
 	resize_screen();
@@ -1337,7 +1997,7 @@ scrollback(const char *args[]) {
 		vt_scroll(sel->term,  sel->h/2);
 
 	draw(sel);
-	curs_set(vt_cursor_visible(sel->term));
+	cursor_show(vt_cursor_visible(sel->term));
 }
 
 static void
@@ -1552,6 +2212,7 @@ handle_cmdfifo(void) {
 
 	r = read(cmdfifo.fd, cmdbuf, sizeof cmdbuf - 1);
 	if (r <= 0) {
+		unwatch_fd(cmdfifo.fd);
 		cmdfifo.fd = -1;
 		return;
 	}
@@ -1672,9 +2333,11 @@ handle_statusbar(void) {
 		case -1:
 			strncpy(bar.text, strerror(errno), sizeof bar.text - 1);
 			bar.text[sizeof bar.text - 1] = '\0';
+			unwatch_fd(bar.fd);
 			bar.fd = -1;
 			break;
 		case 0:
+			unwatch_fd(bar.fd);
 			bar.fd = -1;
 			break;
 		default:
@@ -1713,12 +2376,16 @@ handle_editor(Client *c) {
 	}
 	c->editor_died = false;
 	c->editor_fds[1] = -1;
+	unwatch_pid(&c->editor_pidfd, vt_pid_get(c->editor));
+	unwatch_client(c);
 	vt_destroy(c->editor);
 	c->editor = NULL;
 	c->term = c->app;
+	c->ready = c->queued = false;
+	watch_client(c);
 	vt_dirty(c->term);
 	draw_content(c);
-	wnoutrefresh(c->window);
+	queue_refresh(c->window);
 }
 
 static int
@@ -1803,11 +2470,16 @@ parse_args(int argc, char *argv[]) {
 				break;
 			case 's':
 				bar.fd = open_or_create_fifo(argv[++arg], &bar.file);
+				/* setup() already registered the descriptors it knew of */
+				if (init)
+					watch_fd(bar.fd, &bar.ready);
 				updatebarpos();
 				break;
 			case 'c': {
 				char *fifo;
 				cmdfifo.fd = open_or_create_fifo(argv[++arg], &cmdfifo.file);
+				if (init)
+					watch_fd(cmdfifo.fd, &cmdfifo.ready);
 				if (!(fifo = realpath(argv[arg], NULL)))
 					error("%s\n", strerror(errno));
 				setenv("DVTM_CMD_FIFO", fifo, 1);
@@ -1821,11 +2493,194 @@ parse_args(int argc, char *argv[]) {
 	return init;
 }
 
+/* writes input queued by vt_write(), while some is left the pty is also
+ * waited on for writability */
+static void
+flush_input(Client *c) {
+	/* a thread reading the pty also writes the queued input */
+	if (vt_fd_get(c->term) != vt_pty_get(c->term))
+		return;
+	bool queued = vt_write_flush(c->term) > 0;
+	if (queued == c->queued)
+		return;
+	c->queued = queued;
+#ifdef __linux__
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &c->ready };
+	int op = EPOLL_CTL_MOD;
+#ifdef CONFIG_IO_URING
+	/* the pty is only registered while it is polled for writability */
+	if (c->ringed) {
+		ev.events = 0;
+		ev.data.ptr = NULL;
+		op = queued ? EPOLL_CTL_ADD : EPOLL_CTL_DEL;
+	}
+#endif
+	if (queued)
+		ev.events |= EPOLLOUT;
+	epoll_ctl(poll_fd, op, vt_fd_get(c->term), &ev);
+#endif
+}
+
+static int
+read_client(Client *c, size_t max) {
+	c->ready = false;
+	int n;
+#ifdef CONFIG_IO_URING
+	if (c->ringed) {
+		/* the pty was closed once its application exited */
+		if (c->result <= 0) {
+			errno = c->result ? -c->result : EIO;
+			n = -1;
+		} else {
+			n = vt_readbuf_process(c->term, c->result);
+		}
+	} else
+#endif
+	n = vt_process(c->term, max);
+	if (n < 0 && errno == EIO) {
+		if (c->editor)
+			c->editor_died = true;
+		else
+			c->died = true;
+	}
+	return n;
+}
+
+/* reads the output of the clients with pending data. The focused client
+ * comes first and is not limited, the others take turns until READ_BUDGET
+ * bytes were processed, those left over are served first next time */
+static void
+read_clients(uint64_t now) {
+	if (sel && sel->ready) {
+		if (read_client(sel, SIZE_MAX) >= 0 && now - input_time < ECHO_TIMEOUT)
+			frame_immediate = true;
+	}
+
+	size_t budget = READ_BUDGET;
+	Client *start = readnext ? readnext : clients;
+	readnext = NULL;
+	for (Client *c = start; c; ) {
+		if (c->ready && c != sel) {
+			if (!budget) {
+				readnext = c;
+				break;
+			}
+			int n = read_client(c, MIN(budget, READ_CHUNK * c->priority));
+			if (n > 0)
+				budget -= MIN((size_t)n, budget);
+		}
+		if (!(c = c->next ? c->next : clients) || c == start)
+			break;
+	}
+}
+
+/* waits until one of the watched descriptors becomes readable, the
+ * terminal writable if output is set, or the timeout expires. Marks the
+ * ready descriptors, returns their number or -1 on error */
+static int
+wait_events(bool output, const struct timespec *timeout) {
+#ifdef __linux__
+	struct epoll_event events[64];
+	if (output != poll_output) {
+		struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = NULL };
+		if (!epoll_ctl(poll_fd, output ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, STDOUT_FILENO, &ev))
+			poll_output = output;
+	}
+	int ms = -1;
+	if (timeout)
+		ms = timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000;
+	int completed = 0;
+#ifdef CONFIG_IO_URING
+	if (ring.fd != -1) {
+		bool pending = false;
+		for (Client *c = clients; c; c = c->next) {
+			pending |= c->ready;
+			if (c->ringed && !c->reading && !c->ready && !c->died && !c->editor_died)
+				ring_read(c);
+		}
+		if (!ring.polling) {
+			struct io_uring_sqe *sqe = ring_sqe();
+			if (sqe) {
+				sqe->opcode = IORING_OP_POLL_ADD;
+				sqe->fd = poll_fd;
+				sqe->poll32_events = POLLIN;
+				ring.polling = true;
+			}
+		}
+		/* completions left over by the read budget are handled first */
+		if (ring_enter(pending || ring.events ? 0 : 1, timeout) == -1)
+			return -1;
+		completed = ring_reap();
+		if (!ring.events)
+			return completed;
+		/* the registered descriptors are only checked once the
+		 * epoll instance itself was reported readable */
+		ring.events = false;
+		ms = 0;
+	}
+#endif
+	int n = epoll_wait(poll_fd, events, LENGTH(events), ms);
+	for (int i = 0; i < n; i++) {
+		bool *ready = events[i].data.ptr;
+		if (ready)
+			*ready = true;
+	}
+	return n < 0 ? n : n + completed;
+#else
+	int r, nfds = 0, render = render_fd();
+	fd_set rd, wr;
+	sigset_t emptyset;
+
+	FD_ZERO(&rd);
+	FD_ZERO(&wr);
+	FD_SET(STDIN_FILENO, &rd);
+
+	if (cmdfifo.fd != -1) {
+		FD_SET(cmdfifo.fd, &rd);
+		nfds = cmdfifo.fd;
+	}
+
+	if (bar.fd != -1) {
+		FD_SET(bar.fd, &rd);
+		nfds = MAX(nfds, bar.fd);
+	}
+
+	if (render != -1) {
+		FD_SET(render, &rd);
+		nfds = MAX(nfds, render);
+	}
+
+	if (output) {
+		FD_SET(STDOUT_FILENO, &wr);
+		nfds = MAX(nfds, STDOUT_FILENO);
+	}
+
+	for (Client *c = clients; c; c = c->next) {
+		int fd = vt_fd_get(c->term);
+		FD_SET(fd, &rd);
+		if (c->queued)
+			FD_SET(fd, &wr);
+		nfds = MAX(nfds, fd);
+	}
+
+	sigemptyset(&emptyset);
+	r = pselect(nfds + 1, &rd, &wr, NULL, timeout, &emptyset);
+	if (r <= 0)
+		return r;
+
+	input_ready = FD_ISSET(STDIN_FILENO, &rd);
+	cmdfifo.ready = cmdfifo.fd != -1 && FD_ISSET(cmdfifo.fd, &rd);
+	bar.ready = bar.fd != -1 && FD_ISSET(bar.fd, &rd);
+	for (Client *c = clients; c; c = c->next)
+		c->ready = FD_ISSET(vt_fd_get(c->term), &rd);
+	return r;
+#endif
+}
+
 int
 main(int argc, char *argv[]) {
 	unsigned int key_index = 0;
 	memset(keys, 0, sizeof(keys));
-	sigset_t emptyset, blockset;
 
 	setenv("DVTM", VERSION, 1);
 	if (!parse_args(argc, argv)) {
@@ -1833,35 +2688,17 @@ main(int argc, char *argv[]) {
 		startup(NULL);
 	}
 
-	sigemptyset(&emptyset);
-	sigemptyset(&blockset);
-	sigaddset(&blockset, SIGWINCH);
-	sigaddset(&blockset, SIGCHLD);
-	sigprocmask(SIG_BLOCK, &blockset, NULL);
-
 	while (running) {
-		int r, nfds = 0;
-		fd_set rd;
+		int r;
 
 		if (screen.need_resize) {
 			resize_screen();
 			screen.need_resize = false;
 		}
 
-		FD_ZERO(&rd);
-		FD_SET(STDIN_FILENO, &rd);
-
-		if (cmdfifo.fd != -1) {
-			FD_SET(cmdfifo.fd, &rd);
-			nfds = cmdfifo.fd;
-		}
-
-		if (bar.fd != -1) {
-			FD_SET(bar.fd, &rd);
-			nfds = MAX(nfds, bar.fd);
-		}
-
 		for (Client *c = clients; c; ) {
+			if (c->exited)
+				reap(c);
 			if (c->editor && c->editor_died)
 				handle_editor(c);
 			if (!c->editor && c->died) {
@@ -1870,24 +2707,65 @@ main(int argc, char *argv[]) {
 				c = t;
 				continue;
 			}
-			int pty = c->editor ? vt_pty_get(c->editor) : vt_pty_get(c->app);
-			FD_SET(pty, &rd);
-			nfds = MAX(nfds, pty);
+			flush_input(c);
 			c = c->next;
 		}
 
-		doupdate();
-		r = pselect(nfds + 1, &rd, NULL, NULL, NULL, &emptyset);
+		/* coalesce updates, the screen is refreshed at most REFRESH_RATE
+		 * times per second unless an immediate update was requested */
+		uint64_t now = clock_now(), deadline = 0;
+		if (update_pending) {
+			deadline = frame_last + FRAME_INTERVAL(REFRESH_RATE);
+			if (frame_immediate || now >= deadline) {
+				if (!output_busy())
+					screen_update();
+				deadline = 0;
+			}
+		}
+		/* while the terminal is busy intermediate frames are skipped,
+		 * the latest state is shown once it accepts output again */
+		size_t pending = render_flush();
+		bool output = false;
+		if (render_fd() != -1) {
+			/* the output thread reports when it wrote a frame, which
+			 * might have happened since output_busy() was checked */
+			if (update_pending && !deadline && !pending)
+				deadline = now;
+		} else if ((update_pending && !deadline) || pending) {
+			output = true;
+		}
+		for (Client *c = clients; c; c = c->next) {
+			if (c->deferred && (!deadline || c->deferred < deadline))
+				deadline = c->deferred;
+		}
+
+		struct timespec timeout, *timeoutp = NULL;
+		if (deadline) {
+			uint64_t wait = deadline > now ? deadline - now : 0;
+			timeout.tv_sec = wait / NSEC_PER_SEC;
+			timeout.tv_nsec = wait % NSEC_PER_SEC;
+			timeoutp = &timeout;
+		}
+
+		r = wait_events(output, timeoutp);
 
 		if (r < 0) {
 			if (errno == EINTR)
 				continue;
-			perror("select()");
+			perror("wait_events()");
 			exit(EXIT_FAILURE);
 		}
 
-		if (FD_ISSET(STDIN_FILENO, &rd)) {
-			int code = getch();
+		if (signal_ready) {
+			signal_ready = false;
+			handle_signals();
+		}
+
+		if (input_ready) {
+			input_ready = false;
+			frame_immediate = true;
+			input_time = clock_now();
+			int code = wgetch(keywin);
 			if (code >= 0) {
 				keys[key_index++] = code;
 				KeyBinding *binding = NULL;
@@ -1910,39 +2788,66 @@ main(int argc, char *argv[]) {
 				}
 				drawbar();
 				if (is_content_visible(sel))
-					wnoutrefresh(sel->window);
+					queue_refresh(sel->window);
 			}
 			if (r == 1) /* no data available on pty's */
 				continue;
 		}
 
-		if (cmdfifo.fd != -1 && FD_ISSET(cmdfifo.fd, &rd))
+		if (cmdfifo.ready) {
+			cmdfifo.ready = false;
 			handle_cmdfifo();
+		}
 
-		if (bar.fd != -1 && FD_ISSET(bar.fd, &rd))
+		if (bar.ready) {
+			bar.ready = false;
 			handle_statusbar();
+		}
 
+		now = clock_now();
+		read_clients(now);
 		for (Client *c = clients; c; c = c->next) {
-			if (FD_ISSET(vt_pty_get(c->term), &rd)) {
-				if (vt_process(c->term) < 0 && errno == EIO) {
-					if (c->editor)
-						c->editor_died = true;
-					else
-						c->died = true;
-					continue;
-				}
-			}
+			if (c->died || c->editor_died)
+				continue;
 
-			if (c != sel && is_content_visible(c)) {
-				draw_content(c);
-				wnoutrefresh(c->window);
+			c->deferred = 0;
+			if (!vt_sync_get(c->term))
+				c->sync_start = 0;
+			else if (!c->sync_start)
+				c->sync_start = now;
+			if (!is_content_visible(c) || !vt_damage_get(c->term, NULL))
+				continue;
+			/* hold back incomplete frames of synchronized updates */
+			if (c->sync_start && now - c->sync_start < SYNC_TIMEOUT) {
+				c->deferred = c->sync_start + SYNC_TIMEOUT;
+				continue;
 			}
+			if (c == sel)
+				continue;
+			/* windows without focus are redrawn at a lower rate */
+			if (c->drawn && now - c->drawn < FRAME_INTERVAL(REFRESH_RATE_UNFOCUSED)) {
+				c->deferred = c->drawn + FRAME_INTERVAL(REFRESH_RATE_UNFOCUSED);
+				continue;
+			}
+			draw_content(c);
+			queue_refresh(c->window);
+			c->drawn = now;
 		}
 
 		if (is_content_visible(sel)) {
-			draw_content(sel);
-			curs_set(vt_cursor_visible(sel->term));
-			wnoutrefresh(sel->window);
+			/* the selected window is also refreshed when other
+			 * clients were drawn, it determines the cursor position */
+			VtDamage damage;
+			if (!sel->deferred && vt_damage_get(sel->term, &damage)) {
+				if (damage.rows || damage.scroll)
+					draw_content(sel);
+				else
+					vt_cursor_draw(sel->term, sel->window, sel->has_title_line, 0);
+				cursor_show(vt_cursor_visible(sel->term));
+				queue_refresh(sel->window);
+			} else if (update_pending) {
+				queue_refresh(sel->window);
+			}
 		}
 	}
 
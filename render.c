@@ -0,0 +1,828 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "render.h"
+
+#ifdef CONFIG_DIRECT_RENDER
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <wchar.h>
+#include <langinfo.h>
+#include <sys/uio.h>
+#include <curses.h>
+#include <term.h>
+#ifdef CONFIG_RENDER_THREAD
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#ifndef MAX
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#endif
+
+/* number of unchanged cells which are rather rewritten than jumped over */
+#define GAP_MAX 4
+/* number of entries of the glyph cache, a power of two */
+#define GLYPH_CACHE 256
+
+typedef struct {
+	char *data;
+	size_t off;            /* bytes already written to the terminal */
+	size_t len;
+	size_t size;
+} Output;
+
+/* multibyte encoding and width of a recently displayed character */
+typedef struct {
+	wchar_t wc;
+	unsigned char len;     /* number of bytes, 0 if the entry is unused */
+	signed char width;
+	char bytes[MB_LEN_MAX];
+} Glyph;
+
+typedef struct {
+	bool active;
+	cchar_t *front;        /* cells as currently shown on the terminal */
+	cchar_t *back;         /* row of the composed screen, one cell per column */
+	cchar_t *line;         /* row as returned by win_wchnstr(3) */
+	bool *stale;           /* rows changed by scrolling, to compare in any case */
+	cchar_t blank;         /* space with default attributes */
+	int rows, cols;        /* dimension of the front buffer */
+	int y, x;              /* terminal cursor position, x < 0 if unknown */
+	attr_t attrs;          /* attributes currently set on the terminal */
+	int fg, bg;            /* colors currently set on the terminal */
+	bool cursor;           /* requested cursor visibility */
+	bool cursor_shown;     /* cursor visibility on the terminal */
+	char acs[128];         /* VT100 line drawing character to terminal mapping */
+	wchar_t acs_wide[128]; /* Unicode used instead of line drawing characters, 0 if none */
+	Glyph glyphs[GLYPH_CACHE];
+	int fd;                /* non-blocking descriptor of the terminal */
+	bool backlog;          /* output of a previous frame is still pending */
+	const char *sync;      /* synchronized output capability (Sync) */
+	bool synced;           /* whether a synchronized update was begun */
+	bool lost;             /* output was dropped, the terminal content is unknown */
+	Output out;
+#ifdef CONFIG_RENDER_THREAD
+	Output queue;          /* frame being written by the output thread */
+	pthread_t thread;
+	pthread_mutex_t lock;  /* protects the length of the queue and quit */
+	pthread_cond_t cond;   /* signals a new frame in the queue */
+	bool quit;
+	int wakeup[2];         /* pipe which becomes readable after each frame */
+#endif
+} Renderer;
+
+static Renderer r;
+
+/* marks the second column of a double width character */
+static const cchar_t cell_wide;
+/* never equal to an actual cell, forces a redraw of the column */
+static cchar_t cell_invalid;
+
+static bool cell_eq(const cchar_t *a, const cchar_t *b)
+{
+	return !memcmp(a, b, sizeof(cchar_t));
+}
+
+static void out_write(const char *s, size_t len)
+{
+	Output *o = &r.out;
+	if (o->len + len > o->size) {
+		size_t size = MAX(2 * o->size, o->len + len + BUFSIZ);
+		char *data = realloc(o->data, size);
+		if (!data) {
+			/* the front buffer no longer matches the terminal */
+			r.lost = true;
+			return;
+		}
+		o->data = data;
+		o->size = size;
+	}
+	memcpy(o->data + o->len, s, len);
+	o->len += len;
+}
+
+static int out_putc(int c)
+{
+	char ch = c;
+	out_write(&ch, 1);
+	return c;
+}
+
+static void out_cap(const char *cap)
+{
+	if (cap)
+		tputs(cap, 1, out_putc);
+}
+
+/* writes as much output as the terminal accepts, on error the rest
+ * is discarded */
+static void out_drain(Output *o)
+{
+	while (o->off < o->len) {
+		struct iovec iov = { .iov_base = o->data + o->off, .iov_len = o->len - o->off };
+		ssize_t res = writev(r.fd, &iov, 1);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				o->off = o->len;
+			break;
+		}
+		o->off += res;
+	}
+}
+
+#ifdef CONFIG_RENDER_THREAD
+
+/* writes the frames handed over by out_flush(), the terminal descriptor
+ * is blocking for this thread */
+static void *out_thread(void *arg)
+{
+	pthread_mutex_lock(&r.lock);
+	for (;;) {
+		while (!r.queue.len && !r.quit)
+			pthread_cond_wait(&r.cond, &r.lock);
+		if (!r.queue.len)
+			break;
+		pthread_mutex_unlock(&r.lock);
+		out_drain(&r.queue);
+		pthread_mutex_lock(&r.lock);
+		r.queue.off = r.queue.len = 0;
+		while (write(r.wakeup[1], "", 1) < 0 && errno == EINTR);
+	}
+	pthread_mutex_unlock(&r.lock);
+	return NULL;
+}
+
+static bool out_thread_start(void)
+{
+	sigset_t all, old;
+	if (pipe(r.wakeup) == -1)
+		return false;
+	for (int i = 0; i < 2; i++) {
+		fcntl(r.wakeup[i], F_SETFL, fcntl(r.wakeup[i], F_GETFL) | O_NONBLOCK);
+		fcntl(r.wakeup[i], F_SETFD, FD_CLOEXEC);
+	}
+	/* the thread blocks in write(2), r.fd may be stdout which is left as
+	 * it was found if the thread can not be started */
+	int flags = fcntl(r.fd, F_GETFL);
+	fcntl(r.fd, F_SETFL, flags & ~O_NONBLOCK);
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+	/* signals are left to the main thread, its pselect(2) has to notice them */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int err = pthread_create(&r.thread, NULL, out_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		fcntl(r.fd, F_SETFL, flags);
+		pthread_mutex_destroy(&r.lock);
+		pthread_cond_destroy(&r.cond);
+		close(r.wakeup[0]);
+		close(r.wakeup[1]);
+		return false;
+	}
+	return true;
+}
+
+/* waits until the output thread wrote everything it was handed */
+static void out_thread_stop(void)
+{
+	pthread_mutex_lock(&r.lock);
+	r.quit = true;
+	pthread_cond_signal(&r.cond);
+	pthread_mutex_unlock(&r.lock);
+	pthread_join(r.thread, NULL);
+	pthread_mutex_destroy(&r.lock);
+	pthread_cond_destroy(&r.cond);
+	close(r.wakeup[0]);
+	close(r.wakeup[1]);
+	free(r.queue.data);
+}
+
+/* hands the composed output to the output thread unless it is still busy
+ * with the previous frame, returns the number of bytes not yet written */
+static size_t out_flush(void)
+{
+	char buf[64];
+	while (read(r.wakeup[0], buf, sizeof(buf)) > 0);
+	pthread_mutex_lock(&r.lock);
+	if (!r.queue.len && r.out.len) {
+		Output o = r.queue;
+		r.queue = r.out;
+		r.out = o;
+		pthread_cond_signal(&r.cond);
+	}
+	size_t pending = r.queue.len + r.out.len;
+	pthread_mutex_unlock(&r.lock);
+	return pending;
+}
+
+#else
+
+/* writes as much output as the terminal accepts without blocking,
+ * returns the number of bytes still pending */
+static size_t out_flush(void)
+{
+	Output *o = &r.out;
+	out_drain(o);
+	if (o->off == o->len)
+		o->off = o->len = 0;
+	return o->len - o->off;
+}
+
+#endif /* CONFIG_RENDER_THREAD */
+
+/* makes the terminal hold back the display until sync_end() */
+static void sync_begin(void)
+{
+	if (r.sync && !r.synced) {
+		out_cap(tiparm(r.sync, 1));
+		r.synced = true;
+	}
+}
+
+static void sync_end(void)
+{
+	if (r.synced) {
+		out_cap(tiparm(r.sync, 2));
+		r.synced = false;
+	}
+}
+
+static void pair_colors(int pair, int *fg, int *bg)
+{
+#if NCURSES_EXT_COLORS
+	if (extended_pair_content(pair, fg, bg) == ERR)
+		*fg = *bg = -1;
+#else
+	short f, b;
+	if (pair_content(pair, &f, &b) == ERR)
+		f = b = -1;
+	*fg = f;
+	*bg = b;
+#endif
+}
+
+static void attrs_set(attr_t attrs, int fg, int bg)
+{
+	attrs &= A_ATTRIBUTES & ~A_COLOR;
+	if (!enter_alt_charset_mode)
+		attrs &= ~A_ALTCHARSET;
+	if (attrs == r.attrs && fg == r.fg && bg == r.bg)
+		return;
+
+	attr_t off = r.attrs & ~attrs;
+	if (off == A_ALTCHARSET && exit_alt_charset_mode) {
+		out_cap(exit_alt_charset_mode);
+		r.attrs &= ~A_ALTCHARSET;
+	} else if (off) {
+		out_cap(exit_attribute_mode);
+		r.attrs = A_NORMAL;
+		r.fg = r.bg = -1;
+	}
+
+	attr_t on = attrs & ~r.attrs;
+	if (on & A_STANDOUT)
+		out_cap(enter_standout_mode);
+	if (on & A_UNDERLINE)
+		out_cap(enter_underline_mode);
+	if (on & A_REVERSE)
+		out_cap(enter_reverse_mode);
+	if (on & A_BLINK)
+		out_cap(enter_blink_mode);
+	if (on & A_DIM)
+		out_cap(enter_dim_mode);
+	if (on & A_BOLD)
+		out_cap(enter_bold_mode);
+	if (on & A_INVIS)
+		out_cap(enter_secure_mode);
+#ifdef A_ITALIC
+	if (on & A_ITALIC)
+		out_cap(enter_italics_mode);
+#endif
+	if (on & A_ALTCHARSET)
+		out_cap(enter_alt_charset_mode);
+	r.attrs = attrs;
+
+	if ((fg < 0 && fg != r.fg) || (bg < 0 && bg != r.bg)) {
+		out_cap(orig_pair);
+		r.fg = r.bg = -1;
+	}
+	if (fg != r.fg && set_a_foreground)
+		out_cap(tiparm(set_a_foreground, fg));
+	if (bg != r.bg && set_a_background)
+		out_cap(tiparm(set_a_background, bg));
+	r.fg = fg;
+	r.bg = bg;
+}
+
+/* box drawing characters and other symbols are typically repeated many
+ * times per frame, their encoding is only computed once */
+static const Glyph *glyph_get(wchar_t wc)
+{
+	Glyph *g = &r.glyphs[(wc ^ (wc >> 7)) & (GLYPH_CACHE - 1)];
+	if (g->len && g->wc == wc)
+		return g;
+	mbstate_t ps;
+	memset(&ps, 0, sizeof(ps));
+	size_t len = wcrtomb(g->bytes, wc, &ps);
+	if (len == (size_t)-1 || len == 0) {
+		g->bytes[0] = '?';
+		len = 1;
+	}
+	int width = wcwidth(wc);
+	g->wc = wc;
+	g->len = len;
+	g->width = width > 1 ? width : 1;
+	return g;
+}
+
+/* returns the number of columns occupied by the cell, zero for the string terminator */
+static int cell_width(const cchar_t *cc)
+{
+	wchar_t wch[CCHARW_MAX+1];
+	attr_t attrs;
+	short pair;
+	if (getcchar(cc, wch, &attrs, &pair, NULL) == ERR)
+		return 0;
+	if (attrs & A_ALTCHARSET)
+		return 1;
+	if (!wch[0])
+		return 0;
+	return wch[0] < 128 ? 1 : glyph_get(wch[0])->width;
+}
+
+/* writes the cell at the current terminal position, returns its width */
+static int cell_put(const cchar_t *cc)
+{
+	wchar_t wch[CCHARW_MAX+1] = { 0 };
+	attr_t attrs = A_NORMAL;
+	short spair = 0;
+	int pair = 0, fg, bg;
+#if NCURSES_EXT_COLORS
+	getcchar(cc, wch, &attrs, &spair, &pair);
+#else
+	getcchar(cc, wch, &attrs, &spair, NULL);
+	pair = spair;
+#endif
+	if ((attrs & A_ALTCHARSET) && wch[0] > 0 && wch[0] < 128 && r.acs_wide[wch[0]]) {
+		wch[0] = r.acs_wide[wch[0]];
+		attrs &= ~A_ALTCHARSET;
+	}
+	pair_colors(pair, &fg, &bg);
+	attrs_set(attrs, fg, bg);
+
+	if ((attrs & A_ALTCHARSET) && wch[0] > 0 && wch[0] < 128) {
+		char c = wch[0];
+		if (enter_alt_charset_mode)
+			c = r.acs[(unsigned char)c];
+		else
+			c = c == 'q' ? '-' : c == 'x' ? '|' : '+';
+		out_write(&c, 1);
+		return 1;
+	}
+
+	if (!wch[0])
+		wch[0] = L' ';
+	int width = 1;
+	for (int i = 0; i < CCHARW_MAX && wch[i]; i++) {
+		if (wch[i] < 128) {
+			char c = wch[i];
+			out_write(&c, 1);
+		} else {
+			const Glyph *g = glyph_get(wch[i]);
+			out_write(g->bytes, g->len);
+			if (i == 0)
+				width = g->width;
+		}
+	}
+	return width;
+}
+
+static void cursor_move(int y, int x)
+{
+	if (r.y == y && r.x == x)
+		return;
+	if (r.y == y && r.x >= 0 && x > r.x && x - r.x <= GAP_MAX) {
+		/* rewriting a few unchanged cells is cheaper than a cursor address */
+		const cchar_t *front = r.front + y * r.cols;
+		bool simple = true;
+		for (int i = r.x; i < x && simple; i++)
+			simple = !cell_eq(&front[i], &cell_wide) &&
+			         !cell_eq(&front[i], &cell_invalid) &&
+			         cell_width(&front[i]) == 1;
+		if (simple) {
+			for (; r.x < x; r.x++)
+				cell_put(&front[r.x]);
+			return;
+		}
+	}
+	out_cap(tiparm(cursor_address, y, x));
+	r.y = y;
+	r.x = x;
+}
+
+static void row_render(int y)
+{
+	cchar_t *front = r.front + y * r.cols, *back = r.back;
+	int x = 0;
+
+	if (mvwin_wchnstr(newscr, y, 0, r.line, r.cols) != ERR) {
+		/* win_wchnstr(3) skips the trailing columns of wide characters */
+		for (int i = 0, width; x < r.cols && (width = cell_width(&r.line[i])); i++) {
+			back[x++] = r.line[i];
+			if (width > 1 && x < r.cols)
+				back[x++] = cell_wide;
+		}
+	}
+	while (x < r.cols)
+		back[x++] = r.blank;
+
+	int last = r.cols;
+	if (clr_eol) {
+		while (last > 0 && cell_eq(&back[last-1], &r.blank))
+			last--;
+	}
+
+	for (x = 0; x < r.cols;) {
+		if (cell_eq(&back[x], &front[x])) {
+			x++;
+			continue;
+		}
+		if (x >= last && r.cols - x > 1) {
+			int fg, bg;
+			cursor_move(y, x);
+			pair_colors(0, &fg, &bg);
+			attrs_set(A_NORMAL, fg, bg);
+			out_cap(clr_eol);
+			while (x < r.cols)
+				front[x++] = r.blank;
+			break;
+		}
+		if (y == r.rows - 1 && x == r.cols - 1 && auto_right_margin && !eat_newline_glitch)
+			break;
+		if (cell_eq(&back[x], &cell_wide) && x > 0)
+			x--;
+		cursor_move(y, x);
+		int width = cell_put(&back[x]);
+		if (x + width > r.cols)
+			width = r.cols - x;
+		/* the terminal erases a wide character partially overwritten */
+		if (x + width < r.cols && cell_eq(&front[x+width], &cell_wide))
+			front[x+width] = cell_invalid;
+		memcpy(&front[x], &back[x], width * sizeof(cchar_t));
+		x += width;
+		r.x = x < r.cols ? x : -1;
+	}
+}
+
+static bool render_resize(int rows, int cols)
+{
+	if (rows <= 0 || cols <= 0)
+		return false;
+	cchar_t *front = realloc(r.front, rows * cols * sizeof(cchar_t));
+	if (!front)
+		return false;
+	r.front = front;
+	cchar_t *back = realloc(r.back, cols * sizeof(cchar_t));
+	if (!back)
+		return false;
+	r.back = back;
+	cchar_t *line = realloc(r.line, (cols + 1) * sizeof(cchar_t));
+	if (!line)
+		return false;
+	r.line = line;
+	bool *stale = realloc(r.stale, rows * sizeof(bool));
+	if (!stale)
+		return false;
+	r.stale = stale;
+	memset(stale, 0, rows * sizeof(bool));
+	r.rows = rows;
+	r.cols = cols;
+	return true;
+}
+
+/* whether line drawing characters are written as Unicode, following the
+ * rules of ncurses: in UTF-8 locales if the terminal lacks an alternate
+ * character set or does not support it in UTF-8 mode (U8 capability,
+ * NCURSES_NO_UTF8_ACS, the linux console) */
+static bool acs_unicode(void)
+{
+	const char *cset = nl_langinfo(CODESET);
+	if (!cset || strcmp(cset, "UTF-8"))
+		return false;
+	if (!enter_alt_charset_mode)
+		return true;
+	const char *env = getenv("NCURSES_NO_UTF8_ACS");
+	if (env)
+		return atoi(env) != 0;
+	int u8 = tigetnum("U8");
+	if (u8 >= 0)
+		return u8 > 0;
+	env = getenv("TERM");
+	return env && strstr(env, "linux");
+}
+
+bool render_init(void)
+{
+	if (!cursor_address)
+		return false;
+	memset(&cell_invalid, 0xff, sizeof(cell_invalid));
+	setcchar(&r.blank, L" ", A_NORMAL, 0, NULL);
+	for (int i = 0; i < 128; i++)
+		r.acs[i] = i;
+	for (const char *s = acs_chars; s && s[0] && s[1]; s += 2) {
+		if (!(s[0] & 0x80))
+			r.acs[(unsigned char)s[0]] = s[1];
+	}
+#ifdef NCURSES_WACS
+	/* curses maps them in its wide character table */
+	if (acs_unicode()) {
+		for (int i = 1; i < 128; i++) {
+			wchar_t wch[CCHARW_MAX+1];
+			attr_t attrs;
+			short pair;
+			if (getcchar(NCURSES_WACS(i), wch, &attrs, &pair, NULL) != ERR && wch[0] >= 128)
+				r.acs_wide[i] = wch[0];
+		}
+	}
+#endif
+	r.y = r.x = -1;
+	r.attrs = A_NORMAL;
+	r.fg = r.bg = -1;
+	r.cursor = r.cursor_shown = true;
+	r.sync = tigetstr("Sync");
+	if (r.sync == (char*)-1)
+		r.sync = NULL;
+	if (!render_resize(LINES, COLS))
+		return false;
+	/* output is written through a separate open file description of the
+	 * terminal, making stdout itself non-blocking would also affect stdin
+	 * and the parent process */
+	const char *tty = ttyname(STDOUT_FILENO);
+	r.fd = tty ? open(tty, O_WRONLY|O_NOCTTY|O_NONBLOCK|O_CLOEXEC) : -1;
+	if (r.fd == -1)
+		r.fd = STDOUT_FILENO;
+#ifdef CONFIG_RENDER_THREAD
+	if (!out_thread_start()) {
+		if (r.fd != STDOUT_FILENO)
+			close(r.fd);
+		free(r.front);
+		free(r.back);
+		free(r.line);
+		free(r.stale);
+		return false;
+	}
+#endif
+	/* the first frame repaints everything */
+	clearok(newscr, TRUE);
+	r.active = true;
+	return true;
+}
+
+void render_shutdown(void)
+{
+	if (!r.active)
+		return;
+	out_cap(exit_attribute_mode);
+	out_cap(cursor_normal);
+	if (set_lr_margin)
+		out_cap(clear_margins);
+#ifdef CONFIG_RENDER_THREAD
+	out_thread_stop();
+#endif
+	if (r.fd != STDOUT_FILENO) {
+		fcntl(r.fd, F_SETFL, fcntl(r.fd, F_GETFL) & ~O_NONBLOCK);
+		out_drain(&r.out);
+		close(r.fd);
+	} else {
+		out_drain(&r.out);
+	}
+	free(r.front);
+	free(r.back);
+	free(r.line);
+	free(r.stale);
+	free(r.out.data);
+	memset(&r, 0, sizeof(r));
+}
+
+void render_cursor(bool visible)
+{
+	r.cursor = visible;
+}
+
+int render_fd(void)
+{
+#ifdef CONFIG_RENDER_THREAD
+	if (r.active)
+		return r.wakeup[0];
+#endif
+	return -1;
+}
+
+size_t render_flush(void)
+{
+	if (!r.active)
+		return 0;
+	size_t pending = out_flush();
+	if (!pending)
+		r.backlog = false;
+	return pending;
+}
+
+static bool cell_straddles(const cchar_t *row, int col)
+{
+	return col > 0 && col < r.cols && cell_eq(&row[col], &cell_wide);
+}
+
+/* counts the cells outside of the columns [left, right) which would change
+ * if the whole lines of the region were scrolled */
+static int scroll_damage(int top, int bot, int left, int right, int count)
+{
+	int damage = 0;
+	for (int y = top; y < bot; y++) {
+		const cchar_t *dst = r.front + y * r.cols;
+		int src = y + count;
+		bool fresh = src < top || src >= bot;
+		for (int x = 0; x < r.cols; x++) {
+			if (x == left)
+				x = right;
+			if (x >= r.cols)
+				break;
+			if (fresh)
+				damage += !cell_eq(&dst[x], &r.blank);
+			else
+				damage += !cell_eq(&dst[x], &r.front[src * r.cols + x]);
+		}
+	}
+	return damage;
+}
+
+void render_scroll(int top, int bot, int left, int right, int count)
+{
+	int height = bot - top, n = abs(count);
+
+	/* the scrolled content is redrawn anyway once the terminal caught up */
+	if (!r.active || !count || r.backlog)
+		return;
+	if (top < 0 || bot > r.rows || left < 0 || right > r.cols)
+		return;
+	if (n >= height || left >= right)
+		return;
+	if (count > 0 && !parm_index && !scroll_forward)
+		return;
+	if (count < 0 && !parm_rindex && !scroll_reverse)
+		return;
+
+	/* side by side windows need left and right margins (DECSLRM), without
+	 * them whole lines are scrolled if the rest of them does not change much */
+	bool margins = left > 0 || right < r.cols;
+	if (margins && !set_lr_margin) {
+		int damage = scroll_damage(top, bot, left, right, count);
+		if (2 * damage >= (height - n) * (right - left))
+			return;
+		margins = false;
+		left = 0;
+		right = r.cols;
+	}
+	bool region = top > 0 || bot < r.rows;
+	if (region && !change_scroll_region)
+		return;
+	for (int y = top; y < bot; y++) {
+		const cchar_t *row = r.front + y * r.cols;
+		if (cell_straddles(row, left) || cell_straddles(row, right))
+			return;
+	}
+
+	sync_begin();
+	/* new lines are filled with the current background color */
+	int fg, bg;
+	pair_colors(0, &fg, &bg);
+	attrs_set(A_NORMAL, fg, bg);
+	if (region)
+		out_cap(tiparm(change_scroll_region, top, bot - 1));
+	if (margins)
+		out_cap(tiparm(set_lr_margin, left, right - 1));
+	/* setting the margins moves the cursor to an unspecified position */
+	if (region || margins)
+		r.y = r.x = -1;
+	if (count > 0 && parm_index && (n > 1 || !scroll_forward)) {
+		out_cap(tiparm(parm_index, n));
+	} else if (count > 0) {
+		cursor_move(bot - 1, left);
+		for (int i = 0; i < n; i++)
+			out_cap(scroll_forward);
+	} else if (parm_rindex && (n > 1 || !scroll_reverse)) {
+		out_cap(tiparm(parm_rindex, n));
+	} else {
+		cursor_move(top, left);
+		for (int i = 0; i < n; i++)
+			out_cap(scroll_reverse);
+	}
+	/* on xterm setting the margins enables DECLRMM, which also changes
+	 * the meaning of CSI s, clearing them disables it again */
+	if (margins && clear_margins)
+		out_cap(clear_margins);
+	else if (margins)
+		out_cap(tiparm(set_lr_margin, 0, r.cols - 1));
+	if (region)
+		out_cap(tiparm(change_scroll_region, 0, r.rows - 1));
+	if (region || margins)
+		r.y = r.x = -1;
+
+	size_t size = (right - left) * sizeof(cchar_t);
+	for (int i = 0; i < height - n; i++) {
+		int dst = count > 0 ? top + i : bot - 1 - i;
+		int src = dst + count;
+		memcpy(&r.front[dst * r.cols + left], &r.front[src * r.cols + left], size);
+	}
+	for (int i = 0; i < n; i++) {
+		cchar_t *row = r.front + (count > 0 ? bot - 1 - i : top + i) * r.cols;
+		for (int x = left; x < right; x++)
+			row[x] = r.blank;
+	}
+	for (int y = top; y < bot; y++)
+		r.stale[y] = true;
+}
+
+void render_update(void)
+{
+	bool full = false;
+	int cy, cx;
+
+	if (!r.active)
+		return;
+	if (LINES != r.rows || COLS != r.cols) {
+		if (!render_resize(LINES, COLS))
+			return;
+		full = true;
+	}
+	if (is_cleared(newscr) || r.lost) {
+		clearok(newscr, FALSE);
+		r.lost = false;
+		full = true;
+	}
+
+	getyx(newscr, cy, cx);
+
+	/* frames which only move the cursor are not synchronized */
+	if (full) {
+		sync_begin();
+		out_cap(exit_attribute_mode);
+		r.attrs = A_NORMAL;
+		r.fg = r.bg = -1;
+		out_cap(clear_screen);
+		r.y = r.x = 0;
+		for (int i = 0; i < r.rows * r.cols; i++)
+			r.front[i] = r.blank;
+	}
+
+	for (int y = 0; y < r.rows; y++) {
+		if (full || r.stale[y] || is_linetouched(newscr, y)) {
+			sync_begin();
+			row_render(y);
+		}
+		r.stale[y] = false;
+	}
+	/* mvwin_wchnstr(3) moved the cursor of newscr, restore it */
+	wmove(newscr, cy, cx);
+	wtouchln(newscr, 0, r.rows, 0);
+
+	if (cy >= 0 && cy < r.rows && cx >= 0 && cx < r.cols)
+		cursor_move(cy, cx);
+	if (r.cursor != r.cursor_shown) {
+		out_cap(r.cursor ? cursor_normal : cursor_invisible);
+		r.cursor_shown = r.cursor;
+	}
+	sync_end();
+	r.backlog = out_flush() > 0;
+}
+
+#else
+
+bool render_init(void) { return false; }
+void render_shutdown(void) { }
+void render_cursor(bool visible) { }
+void render_update(void) { }
+size_t render_flush(void) { return 0; }
+int render_fd(void) { return -1; }
+void render_scroll(int top, int bot, int left, int right, int count) { }
+
+#endif /* CONFIG_DIRECT_RENDER */
@@ -0,0 +1,29 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Optional output backend which writes the screen composed by curses
+ * (through wnoutrefresh) to the terminal itself instead of relying on
+ * doupdate(). It keeps a copy of what is currently displayed, diffs the
+ * composed screen against it and emits the resulting escape sequences
+ * with a single writev() per frame. Output is written without blocking,
+ * whatever the terminal does not accept right away stays queued. With
+ * CONFIG_RENDER_THREAD the frames are instead written by a separate thread.
+ */
+
+bool render_init(void);
+void render_shutdown(void);
+void render_cursor(bool visible);
+void render_update(void);
+/* writes queued output, returns the number of bytes still pending */
+size_t render_flush(void);
+/* descriptor which becomes readable once the output thread wrote a frame,
+ * -1 if output is written by render_flush() itself */
+int render_fd(void);
+/* moves the contents of the screen area [top, bot) x [left, right) up by
+ * count lines (down if negative), if the terminal supports it */
+void render_scroll(int top, int bot, int left, int right, int count);
+
+#endif /* RENDER_H */
@@ -32,6 +32,10 @@
 #include <sys/types.h>
 #include <termios.h>
 #include <wchar.h>
+#ifdef CONFIG_READ_THREAD
+# include <poll.h>
+# include <pthread.h>
+#endif
 #if defined(__linux__) || defined(__CYGWIN__)
 # include <pty.h>
 #elif defined(__FreeBSD__) || defined(__DragonFly__)
@@ -79,25 +83,47 @@
 # define CTRL(k)   ((k) & 0x1F)
 #endif
 
+/* 24-bit colors are stored along the palette indices with this flag set */
+#define COLOR_TRUE 0x1000000
+#define COLOR_RGB(r, g, b) (COLOR_TRUE | (r) << 16 | (g) << 8 | (b))
+
 #define IS_CONTROL(ch) !((ch) & 0xffffff60UL)
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
+/* maximal number of bytes queued for an application not reading its input */
+#define WRITE_QUEUE_MAX (1 << 20)
 #define LENGTH(arr) (sizeof(arr) / sizeof((arr)[0]))
 
-static bool is_utf8, has_default_colors;
-static short color_pairs_reserved, color_pairs_max, color_pair_current;
-static short *color2palette, default_fg, default_bg;
+/* color pairs are looked up by their colors through a hash table, those
+ * not reserved by vt_color_reserve() are reused in least recently used
+ * order once all of them have been initialized */
+typedef struct {
+	int fg, bg;
+	short chain;             /* next pair in the same hash bucket, 0 terminated */
+	short prev, next;        /* usage list neighbours, pair 0 is the list head */
+} ColorPair;
+
+static bool is_utf8, has_default_colors, has_direct_colors;
+static short color_pairs_reserved, color_pairs_used, color_pairs_max;
+static ColorPair *color_pairs;
+static short *color_buckets;
+static unsigned int color_buckets_mask;
+static short default_fg, default_bg;
+/* nearest palette color of 24-bit colors with 5 bits per component */
+static unsigned char color_lut[32 * 32 * 32];
+static bool color_lut_valid;
 static char vt_term[32];
 
 typedef struct {
 	wchar_t text;
 	attr_t attr;
-	short fg;
-	short bg;
+	int fg;                /* palette index, COLOR_TRUE flagged RGB or -1 */
+	int bg;
 } Cell;
 
 typedef struct {
 	Cell *cells;
-	unsigned dirty:1;
+	int dirty_start;       /* first column which needs to be redrawn */
+	int dirty_end;         /* column after the last one to redraw, row is clean if <= dirty_start */
 } Row;
 
 /* Buffer holding the current terminal window content (as an array) as well
@@ -161,8 +187,11 @@ typedef struct {
 	attr_t curattrs, savattrs; /* current and saved attributes for cells */
 	int curs_col;          /* current cursor column (zero based) */
 	int curs_srow, curs_scol; /* saved cursor row/colmn (zero based) */
-	short curfg, curbg;    /* current fore and background colors */
-	short savfg, savbg;    /* saved colors */
+	int curfg, curbg;      /* current fore and background colors */
+	int savfg, savbg;      /* saved colors */
+	int scroll_damage;     /* lines the damaged region was rolled since last ack */
+	int scroll_damage_top; /* first row (index into lines) of the rolled region */
+	int scroll_damage_bot; /* row after the last one of the rolled region */
 } Buffer;
 
 struct Vt {
@@ -182,6 +211,7 @@ struct Vt {
 	unsigned bell:1;
 	unsigned relposmode:1;
 	unsigned mousetrack:1;
+	unsigned syncupdate:1;
 	unsigned graphmode:1;
 	unsigned savgraphmode:1;
 	bool charsets[2];
@@ -189,11 +219,39 @@ struct Vt {
 	char rbuf[BUFSIZ];
 	char ebuf[BUFSIZ];
 	unsigned int rlen, elen;
+	char *wbuf;              /* input not yet accepted by the pty */
+	size_t woff, wlen, wsize;
 	int srow, scol;          /* last known offset to display start row, start column */
+	uint64_t *drawn_hash;    /* content hash of each row as last drawn, 0 if unknown */
+	int drawn_rows;          /* number of entries in drawn_hash */
+	cchar_t *run;            /* row cells converted for wadd_wchnstr(3) */
+	int run_size;            /* number of entries in run */
 	char title[256];         /* xterm style window title */
+	struct {
+		wchar_t wc;
+		int width;
+	} glyph_widths[256];     /* widths of recently seen characters, indexed by a hash of them */
 	vt_title_handler_t title_handler; /* hook which is called when title changes */
 	vt_urgent_handler_t urgent_handler; /* hook which is called upon bell */
 	void *data;              /* user supplied data */
+	/* damage tracking */
+	unsigned int damage_gen; /* incremented whenever the terminal state changes */
+	int damage_curs_row;     /* cursor row at last acknowledgement */
+	int damage_curs_col;     /* cursor column at last acknowledgement */
+	bool damage_curs_vis;    /* cursor visibility at last acknowledgement */
+#ifdef CONFIG_READ_THREAD
+	/* output is read and interpreted by a thread of its own */
+	pthread_t reader;
+	pthread_mutex_t lock;    /* guards all of the above against the reader */
+	int notify[2];           /* readable once the reader interpreted output */
+	int control[2];          /* wakes the reader up to write input or to quit */
+	size_t processed;        /* bytes interpreted since the last vt_process() */
+	int error;               /* errno with which the reader stopped, 0 if running */
+	bool reading;            /* whether the reader was started */
+	bool notified;           /* whether notify holds an unread byte */
+	bool quit;               /* asks the reader to stop */
+	bool title_changed;      /* title was set, handlers are called by vt_process() */
+#endif
 };
 
 static const char *keytable[KEY_MAX+1] = {
@@ -254,6 +312,40 @@ static const char *keytable[KEY_MAX+1] = {
 static void puttab(Vt *t, int count);
 static void process_nonprinting(Vt *t, wchar_t wc);
 static void send_curs(Vt *t);
+static void send_mode(Vt *t, int mode);
+
+/* the terminal state is shared with the reader thread, public functions
+ * hold the lock while they access it. It is recursive because they also
+ * call each other */
+static void terminal_lock(Vt *t)
+{
+#ifdef CONFIG_READ_THREAD
+	pthread_mutex_lock(&t->lock);
+#endif
+}
+
+static void terminal_unlock(Vt *t)
+{
+#ifdef CONFIG_READ_THREAD
+	pthread_mutex_unlock(&t->lock);
+#endif
+}
+
+/* wcwidth(3) with a cache in front of it, box drawing characters and
+ * other symbols are typically repeated many times per screen. The cache
+ * is kept per terminal, it is then guarded by the same lock as the rest
+ * of its state */
+static int glyph_width(Vt *t, wchar_t wc)
+{
+	if (wc >= ' ' && wc < 127)
+		return 1;
+	unsigned int i = (wc ^ (wc >> 7)) & (LENGTH(t->glyph_widths) - 1);
+	if (t->glyph_widths[i].wc != wc) {
+		t->glyph_widths[i].wc = wc;
+		t->glyph_widths[i].width = wcwidth(wc);
+	}
+	return t->glyph_widths[i].width;
+}
 
 __attribute__ ((const))
 static attr_t build_attrs(attr_t curattrs)
@@ -262,6 +354,63 @@ static attr_t build_attrs(attr_t curattrs)
 	    >> NCURSES_ATTR_SHIFT;
 }
 
+static void row_dirty(Row *row, int start, int end)
+{
+	if (start < row->dirty_start)
+		row->dirty_start = start;
+	if (end > row->dirty_end)
+		row->dirty_end = end;
+}
+
+static void row_dirty_all(Row *row)
+{
+	row->dirty_start = 0;
+	row->dirty_end = INT_MAX;
+}
+
+static bool row_is_dirty(Row *row)
+{
+	return row->dirty_start < row->dirty_end;
+}
+
+static void row_clean(Row *row)
+{
+	row->dirty_start = INT_MAX;
+	row->dirty_end = 0;
+}
+
+/* Hashes text and style of all cells in a row. Four cells are mixed into
+ * independent lanes per iteration to avoid one long dependency chain. */
+static uint64_t row_hash(Row *row, int cols)
+{
+	const uint64_t prime = 0x100000001b3ULL;
+	uint64_t h[4] = {
+		0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL,
+		0x9e3779b97f4a7c15ULL, 0x7f4a7c159e3779b9ULL,
+	};
+	int i = 0;
+
+	for (; i + 4 <= cols; i += 4) {
+		for (int l = 0; l < 4; l++) {
+			Cell *c = row->cells + i + l;
+			h[l] = (h[l] ^ ((uint64_t)(uint32_t)c->text << 32 | (uint32_t)c->attr)) * prime;
+			h[l] = (h[l] ^ ((uint64_t)(uint32_t)c->fg << 32 | (uint32_t)c->bg)) * prime;
+		}
+	}
+	for (; i < cols; i++) {
+		Cell *c = row->cells + i;
+		h[0] = (h[0] ^ ((uint64_t)(uint32_t)c->text << 32 | (uint32_t)c->attr)) * prime;
+		h[0] = (h[0] ^ ((uint64_t)(uint32_t)c->fg << 32 | (uint32_t)c->bg)) * prime;
+	}
+
+	uint64_t hash = cols;
+	for (int l = 0; l < 4; l++) {
+		hash = (hash ^ h[l]) * prime;
+		hash ^= hash >> 29;
+	}
+	return hash ? hash : 1;
+}
+
 static void row_set(Row *row, int start, int len, Buffer *t)
 {
 	Cell cell = {
@@ -273,25 +422,65 @@ static void row_set(Row *row, int start, int len, Buffer *t)
 
 	for (int i = start; i < len + start; i++)
 		row->cells[i] = cell;
-	row->dirty = true;
+	row_dirty(row, start, start + len);
+}
+
+static void buffer_scroll_damage_drop(Buffer *b)
+{
+	if (!b->scroll_damage)
+		return;
+	for (int i = b->scroll_damage_top; i < b->scroll_damage_bot && i < b->rows; i++)
+		row_dirty_all(&b->lines[i]);
+	b->scroll_damage = 0;
+}
+
+/* returns whether the scroll operation could be recorded, otherwise all
+ * rows of the region have to be redrawn */
+static bool buffer_scroll_damage(Buffer *b, Row *start, Row *end, int count)
+{
+	int top = start - b->lines, bot = end - b->lines;
+
+	if (top < 0 || bot > b->rows)
+		return false;
+	if (b->scroll_damage && (b->scroll_damage_top != top || b->scroll_damage_bot != bot))
+		buffer_scroll_damage_drop(b);
+	b->scroll_damage_top = top;
+	b->scroll_damage_bot = bot;
+	b->scroll_damage += count;
+	if (b->scroll_damage <= -(bot - top) || b->scroll_damage >= bot - top) {
+		buffer_scroll_damage_drop(b);
+		return false;
+	}
+	return true;
 }
 
-static void row_roll(Row *start, Row *end, int count)
+static void row_roll(Buffer *b, Row *start, Row *end, int count)
 {
 	int n = end - start;
 
 	count %= n;
+	if (!count)
+		return;
+
+	/* moved rows keep their dirty state, the consumer of the scroll
+	 * damage shifts what is already drawn. Only the rows wrapped around
+	 * to the other end need to be redrawn completely. */
+	bool tracked = buffer_scroll_damage(b, start, end, count);
+	Row *fresh = count > 0 ? end - count : start;
+	int fresh_count = abs(count);
+	if (!tracked) {
+		fresh = start;
+		fresh_count = n;
+	}
 	if (count < 0)
 		count += n;
 
-	if (count) {
-		char buf[count * sizeof(Row)];
-		memcpy(buf, start, count * sizeof(Row));
-		memmove(start, start + count, (n - count) * sizeof(Row));
-		memcpy(end - count, buf, count * sizeof(Row));
-		for (Row *row = start; row < end; row++)
-			row->dirty = true;
-	}
+	char buf[count * sizeof(Row)];
+	memcpy(buf, start, count * sizeof(Row));
+	memmove(start, start + count, (n - count) * sizeof(Row));
+	memcpy(end - count, buf, count * sizeof(Row));
+	for (Row *row = fresh; row < fresh + fresh_count; row++)
+		row_dirty_all(row);
 }
 
 static void buffer_clear(Buffer *b)
@@ -307,7 +496,7 @@ static void buffer_clear(Buffer *b)
 		Row *row = b->lines + i;
 		for (int j = 0; j < b->cols; j++) {
 			row->cells[j] = cell;
-			row->dirty = true;
+			row_dirty_all(row);
 		}
 	}
 }
@@ -353,7 +542,7 @@ static void buffer_scroll(Buffer *b, int s)
 				b->scroll_index = 0;
 		}
 	}
-	row_roll(b->scroll_top, b->scroll_bot, s);
+	row_roll(b, b->scroll_top, b->scroll_bot, s);
 	if (s < 0 && b->scroll_size) {
 		for (int i = (-s) - 1; i >= 0; i--) {
 			b->scroll_index--;
@@ -363,7 +552,7 @@ static void buffer_scroll(Buffer *b, int s)
 			Row tmp = b->scroll_top[i];
 			b->scroll_top[i] = b->scroll_buf[b->scroll_index];
 			b->scroll_buf[b->scroll_index] = tmp;
-			b->scroll_top[i].dirty = true;
+			row_dirty_all(&b->scroll_top[i]);
 		}
 	}
 }
@@ -390,7 +579,7 @@ static void buffer_resize(Buffer *b, int rows, int cols)
 			lines[row].cells = realloc(lines[row].cells, sizeof(Cell) * cols);
 			if (b->cols < cols)
 				row_set(lines + row, b->cols, cols - b->cols, NULL);
-			lines[row].dirty = true;
+			row_dirty_all(&lines[row]);
 		}
 		Row *sbuf = b->scroll_buf;
 		for (int row = 0; row < b->scroll_size; row++) {
@@ -405,7 +594,7 @@ static void buffer_resize(Buffer *b, int rows, int cols)
 		b->cols = cols;
 	} else if (b->cols != cols) {
 		for (int row = 0; row < b->rows; row++)
-			lines[row].dirty = true;
+			row_dirty_all(&lines[row]);
 		b->cols = cols;
 	}
 
@@ -413,6 +602,7 @@ static void buffer_resize(Buffer *b, int rows, int cols)
 	if (b->rows < rows) {
 		while (b->rows < rows) {
 			lines[b->rows].cells = calloc(b->maxcols, sizeof(Cell));
+			row_dirty_all(lines + b->rows);
 			row_set(lines + b->rows, 0, b->maxcols, b);
 			b->rows++;
 		}
@@ -435,6 +625,8 @@ static void buffer_resize(Buffer *b, int rows, int cols)
 		buffer_scroll(b, -deltarows);
 		b->curs_row += deltarows;
 	}
+
+	buffer_scroll_damage_drop(b);
 }
 
 static bool buffer_init(Buffer *b, int rows, int cols, int scroll_size)
@@ -623,6 +815,14 @@ static bool is_valid_csi_ender(int c)
 	    || (c == '@' || c == '`');
 }
 
+static int sgr_rgb(int param[3])
+{
+	int rgb[3];
+	for (int i = 0; i < 3; i++)
+		rgb[i] = MIN(param[i], 255);
+	return COLOR_RGB(rgb[0], rgb[1], rgb[2]);
+}
+
 /* interprets a 'set attribute' (SGR) CSI escape sequence */
 static void interpret_csi_sgr(Vt *t, int param[], int pcount)
 {
@@ -690,6 +890,9 @@ static void interpret_csi_sgr(Vt *t, int param[], int pcount)
 			if ((i + 2) < pcount && param[i + 1] == 5) {
 				b->curfg = param[i + 2];
 				i += 2;
+			} else if ((i + 4) < pcount && param[i + 1] == 2) {
+				b->curfg = sgr_rgb(param + i + 2);
+				i += 4;
 			}
 			break;
 		case 39:
@@ -702,6 +905,9 @@ static void interpret_csi_sgr(Vt *t, int param[], int pcount)
 			if ((i + 2) < pcount && param[i + 1] == 5) {
 				b->curbg = param[i + 2];
 				i += 2;
+			} else if ((i + 4) < pcount && param[i + 1] == 2) {
+				b->curbg = sgr_rgb(param + i + 2);
+				i += 4;
 			}
 			break;
 		case 49:
@@ -841,6 +1047,7 @@ static void interpret_csi_ich(Vt *t, int param[], int pcount)
 		row->cells[i] = row->cells[i - n];
 
 	row_set(row, b->curs_col, n, b);
+	row_dirty(row, b->curs_col, b->cols);
 }
 
 /* Interpret the 'delete chars' sequence (DCH) */
@@ -857,6 +1064,7 @@ static void interpret_csi_dch(Vt *t, int param[], int pcount)
 		row->cells[i] = row->cells[i + n];
 
 	row_set(row, b->cols - n, n, b);
+	row_dirty(row, b->curs_col, b->cols);
 }
 
 /* Interpret an 'insert line' sequence (IL) */
@@ -869,7 +1077,7 @@ static void interpret_csi_il(Vt *t, int param[], int pcount)
 		for (Row *row = b->curs_row; row < b->scroll_bot; row++)
 			row_set(row, 0, b->cols, b);
 	} else {
-		row_roll(b->curs_row, b->scroll_bot, -n);
+		row_roll(b, b->curs_row, b->scroll_bot, -n);
 		for (Row *row = b->curs_row; row < b->curs_row + n; row++)
 			row_set(row, 0, b->cols, b);
 	}
@@ -885,7 +1093,7 @@ static void interpret_csi_dl(Vt *t, int param[], int pcount)
 		for (Row *row = b->curs_row; row < b->scroll_bot; row++)
 			row_set(row, 0, b->cols, b);
 	} else {
-		row_roll(b->curs_row, b->scroll_bot, n);
+		row_roll(b, b->curs_row, b->scroll_bot, n);
 		for (Row *row = b->scroll_bot - n; row < b->scroll_bot; row++)
 			row_set(row, 0, b->cols, b);
 	}
@@ -984,6 +1192,9 @@ static void interpret_csi_priv_mode(Vt *t, int param[], int pcount, bool set)
 		case 1000: /* enable/disable normal mouse tracking */
 			t->mousetrack = set;
 			break;
+		case 2026: /* begin/end synchronized update */
+			t->syncupdate = set;
+			break;
 		}
 	}
 }
@@ -1018,6 +1229,10 @@ static void interpret_csi(Vt *t)
 		case 'l': /* private set/reset mode */
 			interpret_csi_priv_mode(t, csiparam, param_count, verb == 'h');
 			break;
+		case 'p': /* request private mode (DECRQM) */
+			if (t->elen > 2 && t->ebuf[t->elen - 2] == '$' && param_count == 1)
+				send_mode(t, csiparam[0]);
+			break;
 		}
 		return;
 	}
@@ -1121,7 +1336,7 @@ static void interpret_csi_ri(Vt *t)
 	if (b->curs_row > b->scroll_top)
 		b->curs_row--;
 	else {
-		row_roll(b->scroll_top, b->scroll_bot, -1);
+		row_roll(b, b->scroll_top, b->scroll_bot, -1);
 		row_set(b->scroll_top, 0, b->cols, b);
 	}
 }
@@ -1157,6 +1372,13 @@ static void interpret_osc(Vt *t)
 		switch (command) {
 		case 0: /* icon name and window title */
 		case 2: /* window title */
+#ifdef CONFIG_READ_THREAD
+			if (t->reading) {
+				strncpy(t->title, data+1, sizeof(t->title) - 1);
+				t->title_changed = true;
+				break;
+			}
+#endif
 			if (t->title_handler)
 				t->title_handler(t, data+1);
 			break;
@@ -1280,6 +1502,12 @@ static void process_nonprinting(Vt *t, wchar_t wc)
 		new_escape_sequence(t);
 		break;
 	case '\a': /* BEL */
+#ifdef CONFIG_READ_THREAD
+		if (t->reading) {
+			t->bell = true;
+			break;
+		}
+#endif
 		if (t->urgent_handler)
 			t->urgent_handler(t);
 		break;
@@ -1368,14 +1596,14 @@ static void put_wc(Vt *t, wchar_t wc)
 					wc = gc;
 			}
 			width = 1;
-		} else if ((width = wcwidth(wc)) < 1) {
+		} else if ((width = glyph_width(t, wc)) < 1) {
 			width = 1;
 		}
 		Buffer *b = t->buffer;
 		Cell blank_cell = { L'\0', build_attrs(b->curattrs), b->curfg, b->curbg };
 		if (width == 2 && b->curs_col == b->cols - 1) {
+			row_dirty(b->curs_row, b->curs_col, b->curs_col + 1);
 			b->curs_row->cells[b->curs_col++] = blank_cell;
-			b->curs_row->dirty = true;
 		}
 
 		if (b->curs_col >= b->cols) {
@@ -1388,31 +1616,26 @@ static void put_wc(Vt *t, wchar_t wc)
 			Cell *dest = src + width;
 			size_t len = b->cols - b->curs_col - width;
 			memmove(dest, src, len * sizeof *dest);
+			row_dirty(b->curs_row, b->curs_col, b->cols);
 		}
 
+		row_dirty(b->curs_row, b->curs_col, b->curs_col + width);
 		b->curs_row->cells[b->curs_col] = blank_cell;
 		b->curs_row->cells[b->curs_col++].text = wc;
-		b->curs_row->dirty = true;
 		if (width == 2)
 			b->curs_row->cells[b->curs_col++] = blank_cell;
 	}
 }
 
-int vt_process(Vt *t)
+/* interprets the res bytes which were read into rbuf after the incomplete
+ * multibyte sequence left over from the previous time */
+static int output_interpret(Vt *t, int res)
 {
-	int res;
 	unsigned int pos = 0;
 	mbstate_t ps;
 	memset(&ps, 0, sizeof(ps));
 
-	if (t->pty < 0) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	res = read(t->pty, t->rbuf + t->rlen, sizeof(t->rbuf) - t->rlen);
-	if (res < 0)
-		return -1;
+	t->damage_gen++;
 
 	t->rlen += res;
 	while (pos < t->rlen) {
@@ -1423,7 +1646,7 @@ int vt_process(Vt *t)
 		if (len == -2) {
 			t->rlen -= pos;
 			memmove(t->rbuf, t->rbuf + pos, t->rlen);
-			return 0;
+			return res;
 		}
 
 		if (len == -1) {
@@ -1437,14 +1660,191 @@ int vt_process(Vt *t)
 
 	t->rlen -= pos;
 	memmove(t->rbuf, t->rbuf + pos, t->rlen);
-	return 0;
+	return res;
+}
+
+static int output_process(Vt *t, size_t max)
+{
+	if (t->pty < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	int res = read(t->pty, t->rbuf + t->rlen, MIN(sizeof(t->rbuf) - t->rlen, max));
+	if (res < 0)
+		return -1;
+	return output_interpret(t, res);
+}
+
+#ifdef CONFIG_READ_THREAD
+static void fd_drain(int fd)
+{
+	char buf[64];
+	while (read(fd, buf, sizeof buf) > 0);
+}
+
+static void *output_reader(void *arg)
+{
+	Vt *t = arg;
+
+	for (;;) {
+		struct pollfd fds[] = {
+			{ .fd = t->pty, .events = POLLIN },
+			{ .fd = t->control[0], .events = POLLIN },
+		};
+
+		terminal_lock(t);
+		if (t->quit) {
+			terminal_unlock(t);
+			break;
+		}
+		if (t->woff < t->wlen)
+			fds[0].events |= POLLOUT;
+		terminal_unlock(t);
+
+		int error = 0;
+		if (poll(fds, 2, -1) < 0 && errno != EINTR)
+			error = errno;
+		if (fds[1].revents)
+			fd_drain(t->control[0]);
+
+		terminal_lock(t);
+		if (fds[0].revents & POLLOUT)
+			vt_write_flush(t);
+		if (fds[0].revents & (POLLIN|POLLHUP|POLLERR)) {
+			int res = output_process(t, SIZE_MAX);
+			if (res > 0)
+				t->processed += res;
+			else if (res == 0)
+				error = EIO;
+			else if (errno != EAGAIN && errno != EINTR)
+				error = errno;
+		}
+		t->error = error;
+		if ((t->processed || error) && !t->notified)
+			t->notified = write(t->notify[1], "", 1) == 1;
+		terminal_unlock(t);
+
+		if (error)
+			break;
+	}
+
+	return NULL;
+}
+
+static void reader_start(Vt *t)
+{
+	if (pipe(t->notify))
+		return;
+	if (pipe(t->control)) {
+		close(t->notify[0]);
+		close(t->notify[1]);
+		return;
+	}
+	for (int i = 0; i < 2; i++) {
+		fcntl(t->notify[i], F_SETFL, fcntl(t->notify[i], F_GETFL) | O_NONBLOCK);
+		fcntl(t->control[i], F_SETFL, fcntl(t->control[i], F_GETFL) | O_NONBLOCK);
+	}
+
+	/* signals are handled by the main thread, reading has to be set
+	 * before the reader interprets any output */
+	sigset_t blockset, oldset;
+	sigfillset(&blockset);
+	pthread_sigmask(SIG_SETMASK, &blockset, &oldset);
+	t->reading = true;
+	if (pthread_create(&t->reader, NULL, output_reader, t))
+		t->reading = false;
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (!t->reading) {
+		for (int i = 0; i < 2; i++) {
+			close(t->notify[i]);
+			close(t->control[i]);
+		}
+	}
+}
+
+static void reader_stop(Vt *t)
+{
+	if (!t->reading)
+		return;
+	terminal_lock(t);
+	t->quit = true;
+	terminal_unlock(t);
+	write(t->control[1], "", 1);
+	pthread_join(t->reader, NULL);
+	for (int i = 0; i < 2; i++) {
+		close(t->notify[i]);
+		close(t->control[i]);
+	}
+	t->reading = false;
+}
+
+/* hands the output interpreted by the reader over to the main thread,
+ * where the handlers for the events it encountered are called */
+static int reader_collect(Vt *t)
+{
+	char title[sizeof(t->title)];
+
+	terminal_lock(t);
+	fd_drain(t->notify[0]);
+	t->notified = false;
+	size_t res = t->processed;
+	t->processed = 0;
+	int error = t->error;
+	bool bell = t->bell, title_changed = t->title_changed;
+	t->bell = t->title_changed = false;
+	if (title_changed)
+		memcpy(title, t->title, sizeof(title));
+	terminal_unlock(t);
+
+	if (title_changed && t->title_handler)
+		t->title_handler(t, title);
+	if (bell && t->urgent_handler)
+		t->urgent_handler(t);
+	if (!res && error) {
+		errno = error;
+		return -1;
+	}
+	return MIN(res, INT_MAX);
+}
+#endif /* CONFIG_READ_THREAD */
+
+int vt_process(Vt *t, size_t max)
+{
+#ifdef CONFIG_READ_THREAD
+	if (t->reading)
+		return reader_collect(t);
+#endif
+	return output_process(t, max);
+}
+
+char *vt_readbuf_get(Vt *t, size_t *len)
+{
+	terminal_lock(t);
+	*len = sizeof(t->rbuf) - t->rlen;
+	char *buf = t->rbuf + t->rlen;
+	terminal_unlock(t);
+	return buf;
+}
+
+int vt_readbuf_process(Vt *t, size_t len)
+{
+	terminal_lock(t);
+	int res = output_interpret(t, MIN(len, sizeof(t->rbuf) - t->rlen));
+	terminal_unlock(t);
+	return res;
 }
 
 void vt_default_colors_set(Vt *t, attr_t attrs, short fg, short bg)
 {
+	terminal_lock(t);
 	t->defattrs = attrs;
 	t->deffg = fg;
 	t->defbg = bg;
+	if (t->drawn_hash)
+		memset(t->drawn_hash, 0, t->drawn_rows * sizeof(*t->drawn_hash));
+	terminal_unlock(t);
 }
 
 Vt *vt_create(int rows, int cols, int scroll_size)
@@ -1466,6 +1866,13 @@ Vt *vt_create(int rows, int cols, int scroll_size)
 		return NULL;
 	}
 
+#ifdef CONFIG_READ_THREAD
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&t->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+#endif
 	return t;
 }
 
@@ -1476,33 +1883,111 @@ void vt_resize(Vt *t, int rows, int cols)
 	if (rows <= 0 || cols <= 0)
 		return;
 
+	terminal_lock(t);
 	vt_noscroll(t);
 	buffer_resize(&t->buffer_normal, rows, cols);
 	buffer_resize(&t->buffer_alternate, rows, cols);
 	cursor_clamp(t);
+	t->damage_gen++;
 	ioctl(t->pty, TIOCSWINSZ, &ws);
 	kill(-t->pid, SIGWINCH);
+	terminal_unlock(t);
 }
 
 void vt_destroy(Vt *t)
 {
 	if (!t)
 		return;
+#ifdef CONFIG_READ_THREAD
+	reader_stop(t);
+	pthread_mutex_destroy(&t->lock);
+#endif
 	buffer_free(&t->buffer_normal);
 	buffer_free(&t->buffer_alternate);
+	free(t->drawn_hash);
+	free(t->run);
+	free(t->wbuf);
 	close(t->pty);
 	free(t);
 }
 
 void vt_dirty(Vt *t)
 {
+	terminal_lock(t);
+	Buffer *b = t->buffer;
+	for (Row *row = b->lines, *end = row + b->rows; row < end; row++)
+		row_dirty_all(row);
+	b->scroll_damage = 0;
+	if (t->drawn_hash)
+		memset(t->drawn_hash, 0, t->drawn_rows * sizeof(*t->drawn_hash));
+	t->damage_gen++;
+	terminal_unlock(t);
+}
+
+bool vt_damage_get(Vt *t, VtDamage *damage)
+{
+	terminal_lock(t);
+	Buffer *b = t->buffer;
+	VtDamage d = {
+		.generation = t->damage_gen,
+		.scroll = b->scroll_damage,
+		.scroll_top = b->scroll_damage_top,
+		.scroll_bot = b->scroll_damage_bot,
+	};
+
+	if (!d.scroll)
+		d.scroll_top = d.scroll_bot = 0;
+	for (Row *row = b->lines, *end = row + b->rows; row < end; row++) {
+		if (row_is_dirty(row)) {
+			d.rows = true;
+			break;
+		}
+	}
+	d.cursor = b->curs_row - b->lines != t->damage_curs_row ||
+	           b->curs_col != t->damage_curs_col ||
+	           vt_cursor_visible(t) != t->damage_curs_vis;
+	terminal_unlock(t);
+	if (damage)
+		*damage = d;
+	return d.rows || d.scroll || d.cursor;
+}
+
+bool vt_damage_row_get(Vt *t, int row, int *start, int *end)
+{
+	bool dirty = false;
+	terminal_lock(t);
+	Buffer *b = t->buffer;
+	if (row >= 0 && row < b->rows) {
+		Row *r = b->lines + row;
+		int dirty_end = MIN(r->dirty_end, b->cols);
+		if (r->dirty_start < dirty_end) {
+			if (start)
+				*start = r->dirty_start;
+			if (end)
+				*end = dirty_end;
+			dirty = true;
+		}
+	}
+	terminal_unlock(t);
+	return dirty;
+}
+
+void vt_damage_ack(Vt *t)
+{
+	terminal_lock(t);
 	Buffer *b = t->buffer;
 	for (Row *row = b->lines, *end = row + b->rows; row < end; row++)
-		row->dirty = true;
+		row_clean(row);
+	b->scroll_damage = 0;
+	t->damage_curs_row = b->curs_row - b->lines;
+	t->damage_curs_col = b->curs_col;
+	t->damage_curs_vis = vt_cursor_visible(t);
+	terminal_unlock(t);
 }
 
 void vt_draw(Vt *t, WINDOW *win, int srow, int scol)
 {
+	terminal_lock(t);
 	Buffer *b = t->buffer;
 
 	if (srow != t->srow || scol != t->scol) {
@@ -1511,15 +1996,89 @@ void vt_draw(Vt *t, WINDOW *win, int srow, int scol)
 		t->scol = scol;
 	}
 
+	if (t->drawn_rows != b->rows) {
+		uint64_t *hash = realloc(t->drawn_hash, b->rows * sizeof(*hash));
+		if (hash) {
+			memset(hash, 0, b->rows * sizeof(*hash));
+			t->drawn_hash = hash;
+			t->drawn_rows = b->rows;
+		} else {
+			t->drawn_rows = 0;
+		}
+	}
+
+	if (b->scroll_damage && scol) {
+		buffer_scroll_damage_drop(b);
+	} else if (b->scroll_damage) {
+		/* shift the rows which are already shown instead of redrawing them */
+		int top = b->scroll_damage_top, bot = b->scroll_damage_bot;
+		int count = b->scroll_damage, n = bot - top - abs(count);
+		wsetscrreg(win, srow + top, srow + bot - 1);
+		scrollok(win, TRUE);
+		wscrl(win, count);
+		scrollok(win, FALSE);
+		wsetscrreg(win, 0, getmaxy(win) - 1);
+		if (t->drawn_rows == b->rows) {
+			uint64_t *hash = t->drawn_hash;
+			if (count > 0) {
+				memmove(hash + top, hash + top + count, n * sizeof(*hash));
+				memset(hash + bot - count, 0, count * sizeof(*hash));
+			} else {
+				memmove(hash + top - count, hash + top, n * sizeof(*hash));
+				memset(hash + top, 0, -count * sizeof(*hash));
+			}
+		}
+		b->scroll_damage = 0;
+	}
+
+	if (t->run_size < b->cols) {
+		cchar_t *run = realloc(t->run, b->cols * sizeof(*run));
+		if (!run) {
+			terminal_unlock(t);
+			return;
+		}
+		t->run = run;
+		t->run_size = b->cols;
+	}
+
+	/* curses applies the window attributes to cells without color */
+	wattrset(win, A_NORMAL);
+	wcolor_set(win, 0, NULL);
+
 	for (int i = 0; i < b->rows; i++) {
 		Row *row = b->lines + i;
+		int start = row->dirty_start, end = MIN(row->dirty_end, b->cols);
 
-		if (!row->dirty)
+		if (start >= end)
 			continue;
 
-		wmove(win, srow + i, scol);
+		/* skip rows which were rewritten with identical content, hashing
+		 * is only worth it if a large part of the row would be redrawn */
+		if (i < t->drawn_rows) {
+			uint64_t hash = 0;
+			if (2 * (end - start) >= b->cols) {
+				hash = row_hash(row, b->cols);
+				if (hash == t->drawn_hash[i]) {
+					row_clean(row);
+					continue;
+				}
+			}
+			t->drawn_hash[i] = hash;
+		}
+
+		/* never start in the middle of a double width character */
+		if (start > 0 && is_utf8 && row->cells[start - 1].text >= 128 &&
+		    glyph_width(t, row->cells[start - 1].text) > 1)
+			start--;
+
+		/* convert the span into wide character cells which are handed
+		 * to curses as one run, double width characters occupy a single
+		 * array element */
+		int n = 0;
+		attr_t attrs = A_NORMAL;
+		short pair = 0;
 		Cell *cell = NULL;
-		for (int j = 0; j < b->cols; j++) {
+		for (int j = start; j < end; j++) {
 			Cell *prev_cell = cell;
 			cell = row->cells + j;
 			if (!prev_cell || cell->attr != prev_cell->attr
@@ -1531,40 +2090,66 @@ void vt_draw(Vt *t, WINDOW *win, int srow, int scol)
 					cell->fg = t->deffg;
 				if (cell->bg == -1)
 					cell->bg = t->defbg;
-				wattrset(win, cell->attr << NCURSES_ATTR_SHIFT);
-				wcolor_set(win, vt_color_get(t, cell->fg, cell->bg), NULL);
+				attrs = cell->attr << NCURSES_ATTR_SHIFT;
+				pair = vt_color_get(t, cell->fg, cell->bg);
 			}
 
-			if (is_utf8 && cell->text >= 128) {
-				char buf[MB_CUR_MAX + 1];
-				size_t len = wcrtomb(buf, cell->text, NULL);
-				if (len > 0) {
-					waddnstr(win, buf, len);
-					if (wcwidth(cell->text) > 1)
-						j++;
-				}
+			wchar_t wch[2] = { cell->text, L'\0' };
+			attr_t a = attrs;
+			if (is_utf8) {
+				if (wch[0] >= 128 && glyph_width(t, wch[0]) > 1)
+					j++;
 			} else {
-				waddch(win, cell->text > ' ' ? cell->text : ' ');
+				/* line drawing characters are stored as chtype */
+				chtype ch = cell->text;
+				a |= ch & A_ATTRIBUTES;
+				wch[0] = ch & A_CHARTEXT;
+				if (wch[0] >= 128 && (wint_t)(wch[0] = btowc(wch[0])) == WEOF)
+					wch[0] = '?';
 			}
+			if (wch[0] < ' ')
+				wch[0] = ' ';
+			if (setcchar(&t->run[n], wch, a, pair, NULL) == ERR) {
+				wch[0] = ' ';
+				setcchar(&t->run[n], wch, a, pair, NULL);
+			}
+			n++;
 		}
 
-		int x, y;
-		getyx(win, y, x);
-		(void)y;
-		if (x && x < b->cols - 1)
-			whline(win, ' ', b->cols - x);
-
-		row->dirty = false;
+		mvwadd_wchnstr(win, srow + i, scol + start, t->run, n);
+		row_clean(row);
 	}
 
+	vt_damage_ack(t);
+	wmove(win, srow + b->curs_row - b->lines, scol + b->curs_col);
+	terminal_unlock(t);
+}
+
+void vt_cursor_draw(Vt *t, WINDOW *win, int srow, int scol)
+{
+	terminal_lock(t);
+	Buffer *b = t->buffer;
+
+	if (srow != t->srow || scol != t->scol) {
+		vt_draw(t, win, srow, scol);
+		terminal_unlock(t);
+		return;
+	}
+	t->damage_curs_row = b->curs_row - b->lines;
+	t->damage_curs_col = b->curs_col;
+	t->damage_curs_vis = vt_cursor_visible(t);
 	wmove(win, srow + b->curs_row - b->lines, scol + b->curs_col);
+	terminal_unlock(t);
 }
 
 void vt_scroll(Vt *t, int rows)
 {
+	terminal_lock(t);
 	Buffer *b = t->buffer;
-	if (!b->scroll_size)
+	if (!b->scroll_size) {
+		terminal_unlock(t);
 		return;
+	}
 	if (rows < 0) { /* scroll back */
 		if (rows < -b->scroll_above)
 			rows = -b->scroll_above;
@@ -1574,13 +2159,17 @@ void vt_scroll(Vt *t, int rows)
 	}
 	buffer_scroll(b, rows);
 	b->scroll_below -= rows;
+	t->damage_gen++;
+	terminal_unlock(t);
 }
 
 void vt_noscroll(Vt *t)
 {
+	terminal_lock(t);
 	int scroll_below = t->buffer->scroll_below;
 	if (scroll_below)
 		vt_scroll(t, scroll_below);
+	terminal_unlock(t);
 }
 
 pid_t vt_forkpty(Vt *t, const char *p, const char *argv[], const char *cwd, const char *env[], int *to, int *from)
@@ -1653,6 +2242,12 @@ pid_t vt_forkpty(Vt *t, const char *p, const char *argv[], const char *cwd, cons
 		exit(1);
 	}
 
+	/* writes are queued instead of blocking, see vt_write() */
+	fcntl(t->pty, F_SETFL, fcntl(t->pty, F_GETFL) | O_NONBLOCK);
+#ifdef CONFIG_READ_THREAD
+	reader_start(t);
+#endif
+
 	if (to) {
 		close(vt2ed[0]);
 		*to = vt2ed[1];
@@ -1671,24 +2266,97 @@ int vt_pty_get(Vt *t)
 	return t->pty;
 }
 
-ssize_t vt_write(Vt *t, const char *buf, size_t len)
+int vt_fd_get(Vt *t)
+{
+#ifdef CONFIG_READ_THREAD
+	if (t->reading)
+		return t->notify[0];
+#endif
+	return t->pty;
+}
+
+static ssize_t input_write(Vt *t, const char *buf, size_t len)
 {
 	ssize_t ret = len;
 
-	while (len > 0) {
-		ssize_t res = write(t->pty, buf, len);
-		if (res < 0) {
-			if (errno != EAGAIN && errno != EINTR)
-				return -1;
-			continue;
+	/* previously queued input has to be written first */
+	if (vt_write_flush(t) == 0) {
+		while (len > 0) {
+			ssize_t res = write(t->pty, buf, len);
+			if (res < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					return -1;
+				break;
+			}
+			buf += res;
+			len -= res;
 		}
-		buf += res;
-		len -= res;
 	}
 
+	if (!len)
+		return ret;
+	if (t->woff) {
+		t->wlen -= t->woff;
+		memmove(t->wbuf, t->wbuf + t->woff, t->wlen);
+		t->woff = 0;
+	}
+	if (len > WRITE_QUEUE_MAX - t->wlen) {
+		ret -= len - (WRITE_QUEUE_MAX - t->wlen);
+		len = WRITE_QUEUE_MAX - t->wlen;
+	}
+	if (t->wlen + len > t->wsize) {
+		size_t size = t->wsize ? t->wsize : BUFSIZ;
+		while (size < t->wlen + len)
+			size *= 2;
+		char *wbuf = realloc(t->wbuf, size);
+		if (!wbuf)
+			return ret - len;
+		t->wbuf = wbuf;
+		t->wsize = size;
+	}
+	memcpy(t->wbuf + t->wlen, buf, len);
+	t->wlen += len;
+
 	return ret;
 }
 
+ssize_t vt_write(Vt *t, const char *buf, size_t len)
+{
+	terminal_lock(t);
+	ssize_t ret = input_write(t, buf, len);
+#ifdef CONFIG_READ_THREAD
+	/* queued input is written once the reader sees the pty writable */
+	if (t->reading && t->woff < t->wlen)
+		write(t->control[1], "", 1);
+#endif
+	terminal_unlock(t);
+	return ret;
+}
+
+size_t vt_write_flush(Vt *t)
+{
+	terminal_lock(t);
+	while (t->woff < t->wlen) {
+		ssize_t res = write(t->pty, t->wbuf + t->woff, t->wlen - t->woff);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			/* the application is gone, its input with it */
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				t->woff = t->wlen;
+			break;
+		}
+		t->woff += res;
+	}
+	if (t->woff == t->wlen)
+		t->woff = t->wlen = 0;
+	size_t left = t->wlen - t->woff;
+	terminal_unlock(t);
+	return left;
+}
+
 static void send_curs(Vt *t)
 {
 	Buffer *b = t->buffer;
@@ -1697,8 +2365,44 @@ static void send_curs(Vt *t)
 	vt_write(t, keyseq, strlen(keyseq));
 }
 
+static void send_mode(Vt *t, int mode)
+{
+	int set;
+	switch (mode) {
+	case 1:
+		set = t->curskeymode;
+		break;
+	case 6:
+		set = t->relposmode;
+		break;
+	case 25:
+		set = !t->curshid;
+		break;
+	case 47:
+	case 1047:
+	case 1049:
+		set = t->buffer == &t->buffer_alternate;
+		break;
+	case 1000:
+		set = t->mousetrack;
+		break;
+	case 2026:
+		set = t->syncupdate;
+		break;
+	default:
+		set = -1;
+		break;
+	}
+	/* 0: not recognized, 1: set, 2: reset */
+	int value = set < 0 ? 0 : set ? 1 : 2;
+	char keyseq[32];
+	snprintf(keyseq, sizeof keyseq, "\e[?%d;%d$y", mode, value);
+	vt_write(t, keyseq, strlen(keyseq));
+}
+
 void vt_keypress(Vt *t, int keycode)
 {
+	terminal_lock(t);
 	vt_noscroll(t);
 
 	if (keycode >= 0 && keycode <= KEY_MAX && keytable[keycode]) {
@@ -1722,6 +2426,7 @@ void vt_keypress(Vt *t, int keycode)
 		fprintf(stderr, "unhandled key %#o\n", keycode);
 #endif
 	}
+	terminal_unlock(t);
 }
 
 void vt_mouse(Vt *t, int x, int y, mmask_t mask)
@@ -1729,7 +2434,10 @@ void vt_mouse(Vt *t, int x, int y, mmask_t mask)
 #ifdef NCURSES_MOUSE_VERSION
 	char seq[6] = { '\e', '[', 'M' }, state = 0, button = 0;
 
-	if (!t->mousetrack)
+	terminal_lock(t);
+	bool mousetrack = t->mousetrack;
+	terminal_unlock(t);
+	if (!mousetrack)
 		return;
 
 	if (mask & (BUTTON1_PRESSED | BUTTON1_CLICKED))
@@ -1763,17 +2471,144 @@ void vt_mouse(Vt *t, int x, int y, mmask_t mask)
 #endif /* NCURSES_MOUSE_VERSION */
 }
 
-static unsigned int color_hash(short fg, short bg)
+static unsigned int color_hash(int fg, int bg)
 {
-	if (fg == -1)
-		fg = COLORS;
-	if (bg == -1)
-		bg = COLORS + 1;
-	return fg * (COLORS + 2) + bg;
+	unsigned int h = ((unsigned int)fg * 0x85ebca6bU ^ (unsigned int)bg) * 2654435761U;
+	return (h >> 16) & color_buckets_mask;
 }
 
-short vt_color_get(Vt *t, short fg, short bg)
+static short color_pair_find(int fg, int bg)
 {
+	for (short p = color_buckets[color_hash(fg, bg)]; p; p = color_pairs[p].chain) {
+		if (color_pairs[p].fg == fg && color_pairs[p].bg == bg)
+			return p;
+	}
+	return 0;
+}
+
+static void color_pair_hash(short pair, int fg, int bg)
+{
+	unsigned int h = color_hash(fg, bg);
+	color_pairs[pair].fg = fg;
+	color_pairs[pair].bg = bg;
+	color_pairs[pair].chain = color_buckets[h];
+	color_buckets[h] = pair;
+}
+
+static void color_pair_unhash(short pair)
+{
+	short *p = &color_buckets[color_hash(color_pairs[pair].fg, color_pairs[pair].bg)];
+	while (*p && *p != pair)
+		p = &color_pairs[*p].chain;
+	if (*p)
+		*p = color_pairs[pair].chain;
+}
+
+/* inserts pair into the usage list after the given one, 0 being the head */
+static void color_pair_link(short pair, short after)
+{
+	ColorPair *cp = &color_pairs[pair];
+	cp->prev = after;
+	cp->next = color_pairs[after].next;
+	color_pairs[cp->next].prev = pair;
+	color_pairs[after].next = pair;
+}
+
+static void color_pair_unlink(short pair)
+{
+	ColorPair *cp = &color_pairs[pair];
+	color_pairs[cp->prev].next = cp->next;
+	color_pairs[cp->next].prev = cp->prev;
+}
+
+static bool color_pair_init(short pair, int fg, int bg)
+{
+#if NCURSES_EXT_COLORS
+	return init_extended_pair(pair, fg, bg) == OK;
+#else
+	return init_pair(pair, fg, bg) == OK;
+#endif
+}
+
+/* RGB values of the xterm 256 and 88 color palettes */
+static void palette_rgb(int color, int rgb[3])
+{
+	static const unsigned char ansi[16][3] = {
+		{ 0x00, 0x00, 0x00 }, { 0xcd, 0x00, 0x00 }, { 0x00, 0xcd, 0x00 }, { 0xcd, 0xcd, 0x00 },
+		{ 0x00, 0x00, 0xee }, { 0xcd, 0x00, 0xcd }, { 0x00, 0xcd, 0xcd }, { 0xe5, 0xe5, 0xe5 },
+		{ 0x7f, 0x7f, 0x7f }, { 0xff, 0x00, 0x00 }, { 0x00, 0xff, 0x00 }, { 0xff, 0xff, 0x00 },
+		{ 0x5c, 0x5c, 0xff }, { 0xff, 0x00, 0xff }, { 0x00, 0xff, 0xff }, { 0xff, 0xff, 0xff },
+	};
+	static const unsigned char cube256[] = { 0x00, 0x5f, 0x87, 0xaf, 0xd7, 0xff };
+	static const unsigned char cube88[] = { 0x00, 0x8b, 0xcd, 0xff };
+	static const unsigned char gray88[] = { 0x2e, 0x5c, 0x73, 0x8b, 0xa2, 0xb9, 0xd0, 0xe7 };
+
+	if (color < 16) {
+		for (int i = 0; i < 3; i++)
+			rgb[i] = ansi[color][i];
+	} else if (COLORS < 256) {
+		if (color < 80) {
+			color -= 16;
+			rgb[0] = cube88[color / 16];
+			rgb[1] = cube88[color / 4 % 4];
+			rgb[2] = cube88[color % 4];
+		} else {
+			rgb[0] = rgb[1] = rgb[2] = gray88[color - 80];
+		}
+	} else if (color < 232) {
+		color -= 16;
+		rgb[0] = cube256[color / 36];
+		rgb[1] = cube256[color / 6 % 6];
+		rgb[2] = cube256[color % 6];
+	} else {
+		rgb[0] = rgb[1] = rgb[2] = 8 + 10 * (color - 232);
+	}
+}
+
+/* fills the lookup table mapping 24-bit colors to the nearest color of the
+ * palette, for 88 and 256 colors only the color cube and the gray ramp are
+ * considered because the first 16 colors are often customized */
+static void color_lut_init(void)
+{
+	int first = COLORS >= 88 ? 16 : 0;
+	int last = COLORS >= 256 ? 256 : COLORS >= 88 ? 88 : MIN(COLORS, 16);
+	int palette[256][3];
+	for (int c = first; c < last; c++)
+		palette_rgb(c, palette[c]);
+	for (int i = 0; i < (int)LENGTH(color_lut); i++) {
+		int rgb[3] = { (i >> 10) << 3 | 4, (i >> 5 & 31) << 3 | 4, (i & 31) << 3 | 4 };
+		int best = first, best_dist = INT_MAX;
+		for (int c = first; c < last; c++) {
+			int dist = 0;
+			for (int j = 0; j < 3; j++)
+				dist += (rgb[j] - palette[c][j]) * (rgb[j] - palette[c][j]);
+			if (dist < best_dist) {
+				best = c;
+				best_dist = dist;
+			}
+		}
+		color_lut[i] = best;
+	}
+	color_lut_valid = true;
+}
+
+/* maps a COLOR_TRUE flagged color to one the terminal can display */
+static int color_rgb(int color)
+{
+	if (has_direct_colors)
+		return color & 0xffffff;
+	if (!color_lut_valid)
+		color_lut_init();
+	int r = (color >> 16) & 0xff, g = (color >> 8) & 0xff, b = color & 0xff;
+	return color_lut[(r >> 3) << 10 | (g >> 3) << 5 | b >> 3];
+}
+
+short vt_color_get(Vt *t, int fg, int bg)
+{
+	if (fg >= COLOR_TRUE)
+		fg = color_rgb(fg);
+	if (bg >= COLOR_TRUE)
+		bg = color_rgb(bg);
 	if (fg >= COLORS)
 		fg = (t ? t->deffg : default_fg);
 	if (bg >= COLORS)
@@ -1786,33 +2621,39 @@ short vt_color_get(Vt *t, short fg, short bg)
 			bg = (t && t->defbg != -1 ? t->defbg : default_bg);
 	}
 
-	if (!color2palette || (fg == -1 && bg == -1))
+	if (!color_pairs || (fg == -1 && bg == -1))
 		return 0;
-	unsigned int index = color_hash(fg, bg);
-	if (color2palette[index] == 0) {
-		short oldfg, oldbg;
-		for (;;) {
-			if (++color_pair_current >= color_pairs_max)
-				color_pair_current = color_pairs_reserved + 1;
-			pair_content(color_pair_current, &oldfg, &oldbg);
-			unsigned int old_index = color_hash(oldfg, oldbg);
-			if (color2palette[old_index] >= 0) {
-				if (init_pair(color_pair_current, fg, bg) == OK) {
-					color2palette[old_index] = 0;
-					color2palette[index] = color_pair_current;
-				}
-				break;
-			}
+	short pair = color_pair_find(fg, bg);
+	if (pair > color_pairs_reserved) {
+		if (color_pairs[0].next != pair) {
+			color_pair_unlink(pair);
+			color_pair_link(pair, 0);
 		}
+		return pair;
+	} else if (pair) {
+		return pair;
 	}
 
-	short color_pair = color2palette[index];
-	return color_pair >= 0 ? color_pair : -color_pair;
+	/* pairs are initialized on first use, afterwards the least recently
+	 * used one is evicted */
+	bool evict = color_pairs_used + 1 >= color_pairs_max;
+	pair = evict ? color_pairs[0].prev : color_pairs_used + 1;
+	if (!pair || !color_pair_init(pair, fg, bg))
+		return 0;
+	if (evict) {
+		color_pair_unlink(pair);
+		color_pair_unhash(pair);
+	} else {
+		color_pairs_used = pair;
+	}
+	color_pair_hash(pair, fg, bg);
+	color_pair_link(pair, 0);
+	return pair;
 }
 
 short vt_color_reserve(short fg, short bg)
 {
-	if (!color2palette || fg >= COLORS || bg >= COLORS)
+	if (!color_pairs || fg >= COLORS || bg >= COLORS)
 		return 0;
 	if (!has_default_colors && fg == -1)
 		fg = default_fg;
@@ -1820,13 +2661,28 @@ short vt_color_reserve(short fg, short bg)
 		bg = default_bg;
 	if (fg == -1 && bg == -1)
 		return 0;
-	unsigned int index = color_hash(fg, bg);
-	if (color2palette[index] >= 0) {
-		if (init_pair(color_pairs_reserved + 1, fg, bg) == OK)
-			color2palette[index] = -(++color_pairs_reserved);
+	short pair = color_pair_find(fg, bg);
+	if ((pair && pair <= color_pairs_reserved) || color_pairs_reserved + 1 >= color_pairs_max)
+		return pair;
+	short reserved = color_pairs_reserved + 1;
+	if (!color_pair_init(reserved, fg, bg))
+		return pair;
+	if (reserved <= color_pairs_used) {
+		/* taken away from the pairs in use */
+		color_pair_unlink(reserved);
+		color_pair_unhash(reserved);
+	} else {
+		color_pairs_used = reserved;
 	}
-	short color_pair = color2palette[index];
-	return color_pair >= 0 ? color_pair : -color_pair;
+	if (pair && pair != reserved) {
+		/* the previous pair of these colors is no longer needed */
+		color_pair_unhash(pair);
+		color_pair_unlink(pair);
+		color_pair_link(pair, color_pairs[0].prev);
+	}
+	color_pair_hash(reserved, fg, bg);
+	color_pairs_reserved = reserved;
+	return reserved;
 }
 
 static void init_colors(void)
@@ -1837,17 +2693,25 @@ static void init_colors(void)
 	if (default_bg == -1)
 		default_bg = COLOR_BLACK;
 	has_default_colors = (use_default_colors() == OK);
+#if NCURSES_EXT_COLORS
+	/* terminals with the RGB capability take 24-bit values as colors */
+	has_direct_colors = COLORS >= COLOR_TRUE && tigetflag("RGB") > 0;
+#endif
 	color_pairs_max = MIN(MAX_COLOR_PAIRS, SHRT_MAX);
-	if (COLORS)
-		color2palette = calloc((COLORS + 2) * (COLORS + 2), sizeof(short));
-	/*
-	 * XXX: On undefined color-pairs NetBSD curses pair_content() set fg
-	 *      and bg to default colors while ncurses set them respectively to
-	 *      0 and 0. Initialize all color-pairs in order to have consistent
-	 *      behaviour despite the implementation used.
-	 */
-	for (short i = 1; i < color_pairs_max; i++)
-		init_pair(i, 0, 0);
+	if (COLORS && color_pairs_max > 1) {
+		unsigned int buckets = 1;
+		while (buckets < (unsigned int)color_pairs_max)
+			buckets *= 2;
+		color_buckets = calloc(buckets, sizeof(short));
+		color_pairs = calloc(color_pairs_max, sizeof(ColorPair));
+		if (!color_buckets || !color_pairs) {
+			free(color_buckets);
+			free(color_pairs);
+			color_buckets = NULL;
+			color_pairs = NULL;
+		}
+		color_buckets_mask = buckets - 1;
+	}
 	vt_color_reserve(COLOR_WHITE, COLOR_BLACK);
 }
 
@@ -1872,7 +2736,8 @@ void vt_keytable_set(const char * const keytable_overlay[], int count)
 
 void vt_shutdown(void)
 {
-	free(color2palette);
+	free(color_pairs);
+	free(color_buckets);
 }
 
 void vt_title_handler_set(Vt *t, vt_title_handler_t handler)
@@ -1897,7 +2762,18 @@ void *vt_data_get(Vt *t)
 
 bool vt_cursor_visible(Vt *t)
 {
-	return t->buffer->scroll_below ? false : !t->curshid;
+	terminal_lock(t);
+	bool visible = t->buffer->scroll_below ? false : !t->curshid;
+	terminal_unlock(t);
+	return visible;
+}
+
+bool vt_sync_get(Vt *t)
+{
+	terminal_lock(t);
+	bool sync = t->syncupdate;
+	terminal_unlock(t);
+	return sync;
 }
 
 pid_t vt_pid_get(Vt *t)
@@ -1907,14 +2783,17 @@ pid_t vt_pid_get(Vt *t)
 
 size_t vt_content_get(Vt *t, char **buf, bool colored)
 {
+	terminal_lock(t);
 	Buffer *b = t->buffer;
 	int lines = b->scroll_above + b->scroll_below + b->rows + 1;
 	size_t size = lines * ((b->cols + 1) * ((colored ? 64 : 0) + MB_CUR_MAX));
 	mbstate_t ps;
 	memset(&ps, 0, sizeof(ps));
 
-	if (!(*buf = malloc(size)))
+	if (!(*buf = malloc(size))) {
+		terminal_unlock(t);
 		return 0;
+	}
 
 	char *s = *buf;
 	Cell *prev_cell = NULL;
@@ -1941,6 +2820,9 @@ size_t vt_content_get(Vt *t, char **buf, bool colored)
 				if (!prev_cell || cell->fg != prev_cell->fg || cell->attr != prev_cell->attr) {
 					if (cell->fg == -1)
 						esclen = sprintf(s, "\033[39m");
+					else if (cell->fg >= COLOR_TRUE)
+						esclen = sprintf(s, "\033[38;2;%d;%d;%dm", cell->fg >> 16 & 0xff,
+						                 cell->fg >> 8 & 0xff, cell->fg & 0xff);
 					else
 						esclen = sprintf(s, "\033[38;5;%dm", cell->fg);
 					if (esclen > 0)
@@ -1949,6 +2831,9 @@ size_t vt_content_get(Vt *t, char **buf, bool colored)
 				if (!prev_cell || cell->bg != prev_cell->bg || cell->attr != prev_cell->attr) {
 					if (cell->bg == -1)
 						esclen = sprintf(s, "\033[49m");
+					else if (cell->bg >= COLOR_TRUE)
+						esclen = sprintf(s, "\033[48;2;%d;%d;%dm", cell->bg >> 16 & 0xff,
+						                 cell->bg >> 8 & 0xff, cell->bg & 0xff);
 					else
 						esclen = sprintf(s, "\033[48;5;%dm", cell->bg);
 					if (esclen > 0)
@@ -1972,10 +2857,14 @@ size_t vt_content_get(Vt *t, char **buf, bool colored)
 		*s++ = '\n';
 	}
 
+	terminal_unlock(t);
 	return s - *buf;
 }
 
 int vt_content_start(Vt *t)
 {
-	return t->buffer->scroll_above;
+	terminal_lock(t);
+	int start = t->buffer->scroll_above;
+	terminal_unlock(t);
+	return start;
 }
@@ -30,6 +30,16 @@ typedef struct Vt Vt;
 typedef void (*vt_title_handler_t)(Vt*, const char *title);
 typedef void (*vt_urgent_handler_t)(Vt*);
 
+/* changes to the visible terminal content since the last acknowledgement */
+typedef struct {
+	unsigned int generation; /* incremented whenever the terminal state changes */
+	int scroll;              /* lines the region below was scrolled up (<0 down) */
+	int scroll_top;          /* first row of the scrolled region */
+	int scroll_bot;          /* row after the last one of the scrolled region */
+	bool rows;               /* whether any row has dirty cells */
+	bool cursor;             /* whether cursor position or visibility changed */
+} VtDamage;
+
 void vt_init(void);
 void vt_shutdown(void);
 
@@ -45,15 +55,39 @@ void vt_resize(Vt*, int rows, int cols);
 void vt_destroy(Vt*);
 pid_t vt_forkpty(Vt*, const char *p, const char *argv[], const char *cwd, const char *env[], int *to, int *from);
 int vt_pty_get(Vt*);
+/* descriptor which becomes readable once there is output to process, with
+ * CONFIG_READ_THREAD the one signalled by the thread reading the pty */
+int vt_fd_get(Vt*);
 bool vt_cursor_visible(Vt*);
+bool vt_sync_get(Vt*);
 
-int vt_process(Vt *);
+/* reads and interprets at most max bytes of output, returns the number
+ * of bytes read or -1 on error. With CONFIG_READ_THREAD this already
+ * happened on the reader thread, the number of bytes interpreted since
+ * the last call is returned regardless of max and the title and urgent
+ * handlers are called from here */
+int vt_process(Vt *, size_t max);
+/* for reading the output by other means: returns the buffer into which at
+ * most len bytes can be read, vt_readbuf_process() then interprets the
+ * len bytes which were placed there. The buffer remains valid until the
+ * next call to vt_process(), vt_readbuf_process() or vt_destroy() */
+char *vt_readbuf_get(Vt *, size_t *len);
+int vt_readbuf_process(Vt *, size_t len);
 void vt_keypress(Vt *, int keycode);
+/* writes input to the application, what the pty does not accept right away
+ * is queued up to a limit. Returns the number of bytes written or queued */
 ssize_t vt_write(Vt*, const char *buf, size_t len);
+/* writes queued input without blocking, returns the number of bytes left */
+size_t vt_write_flush(Vt*);
 void vt_mouse(Vt*, int x, int y, mmask_t mask);
 void vt_dirty(Vt*);
 void vt_draw(Vt*, WINDOW *win, int startrow, int startcol);
-short vt_color_get(Vt*, short fg, short bg);
+/* only positions the cursor, for when nothing but it changed since vt_draw() */
+void vt_cursor_draw(Vt*, WINDOW *win, int startrow, int startcol);
+bool vt_damage_get(Vt*, VtDamage*);
+bool vt_damage_row_get(Vt*, int row, int *start, int *end);
+void vt_damage_ack(Vt*);
+short vt_color_get(Vt*, int fg, int bg);
 short vt_color_reserve(short fg, short bg);
 
 void vt_scroll(Vt*, int rows);